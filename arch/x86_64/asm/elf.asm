@@ -20,6 +20,7 @@
 section .text
 
 global elf_user_trampoline_stub
+global elf_fork_return_stub
 
 ; void elf_user_trampoline_stub(uint64_t entry, uint64_t stack);
 elf_user_trampoline_stub:
@@ -44,3 +45,34 @@ elf_user_trampoline_stub:
     push rdi            ; RIP (The 64-bit User ELF Entry Point)
 
     iretq
+
+; void elf_fork_return_stub(syscalls_registers_x86_64_t* regs);
+elf_fork_return_stub:
+    ; RDI = The register frame SYS_FORK was called with, which also holds the
+    ; user RIP, CS, RFLAGS, RSP and SS for iretq, just as the syscall stub left it
+    mov bx, 0x23
+    mov ds, bx
+    mov es, bx
+    mov fs, bx
+    mov gs, bx
+
+    mov rsp, rdi
+
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop r11
+    pop r10
+    pop r9
+    pop r8
+    pop rdi
+    pop rsi
+    pop rbp
+    pop rbx
+    pop rdx
+    pop rcx
+    pop rax
+
+    add rsp, 16         ; Skip int_no and err_code
+    iretq
@@ -32,6 +32,7 @@ extern keyboard_handler
 extern mouse_handler
 extern syscall_handler
 extern exception_handler
+extern page_fault_handler
 extern ahci_interrupt_handler
 extern apic_spurious_handler
 
@@ -148,7 +149,6 @@ ISR_ERRCODE   10
 ISR_ERRCODE   11
 ISR_ERRCODE   12
 ISR_ERRCODE   13
-ISR_ERRCODE   14
 ISR_NOERRCODE 15
 ISR_NOERRCODE 16
 ISR_ERRCODE   17
@@ -167,6 +167,19 @@ ISR_NOERRCODE 29
 ISR_ERRCODE   30
 ISR_NOERRCODE 31
 
+; Page faults are usually resolved and returned from, so they get their own path
+global isr14
+isr14:
+    push 14             ; CPU already pushed error code, just push exception number
+    PUSHALL
+
+    mov rdi, rsp
+    call page_fault_handler
+
+    POPALL
+    add rsp, 16         ; Clean up exception number and error code stack variables
+    iretq
+
 isr_common_stub:
     PUSHALL
 
@@ -87,6 +87,7 @@ _start:
     mov $p3_table, %eax
     or $0x3, %eax                 /* Present flag + Writable flag (0x1 | 0x2) */
     mov %eax, (p4_table)          /* Entry 0: Identity map lower memory */
+    mov %eax, p4_table + 256 * 8  /* Entry 256: Direct map of physical memory, until init_vmm maps all of it */
     mov %eax, p4_table + 511 * 8  /* Entry 511: Higher-half kernel space virtual mapping */
 
     /* Link P3 entries to the P2 table address */
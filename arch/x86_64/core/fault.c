@@ -0,0 +1,43 @@
+/*
+-----------------------------------------------------------------------
+Farix Operating System
+Copyright (C) 2026  Faris Muhammad
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+-----------------------------------------------------------------------
+*/
+
+#include <stdint.h>
+
+#include "hal.h"
+
+#include "memory/vma.h"
+#include "process/task.h"
+
+// Defined in panic.c
+void exception_handler(syscalls_registers_x86_64_t* regs);
+
+/*
+Called by isr14 on a page fault. A fault the current task's VMAs account for is
+resolved by vma_handle_fault, and the faulting instruction runs again once this
+returns. Anything else is a genuine fault, and goes to the panic path.
+*/
+void page_fault_handler(syscalls_registers_x86_64_t* regs) {
+    uint64_t faulting_address;
+    asm volatile("mov %%cr2, %0" : "=r"(faulting_address));
+
+    if (likely(vma_handle_fault(current_task, faulting_address, regs->err_code))) return;
+
+    exception_handler(regs);
+}
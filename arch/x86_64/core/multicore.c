@@ -36,6 +36,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 // These hold the data collected during the early MADT parse pass
 uint8_t  core_apic_ids[MAX_CORES];
+uint8_t  core_apic_index[MAX_CORES]; // Reverse of core_apic_ids, indexed by LAPIC ID
 uint32_t core_count = 0;
 
 /* Broadcasts the INIT signal to every secondary core on the system bus at once. */
@@ -60,3 +61,13 @@ void init_multicore() {
     broadcast_startup_ipi(TRAMPOLINE_PAGE_VECTOR);
     timer_dev->stall(1000);  // 1 ms flat delay for the whole system
 }
+
+/*
+Index (0 to core_count - 1) of the core executing this. Until the MADT has been
+parsed, or on a single core machine, this is always the bootstrap core, which
+also saves us the LAPIC read.
+*/
+uint32_t get_core_id() {
+    if (likely(core_count <= 1)) return 0;
+    return core_apic_index[lapic_read(LAPIC_REG_ID) >> LAPIC_ID_SHIFT];
+}
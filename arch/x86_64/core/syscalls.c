@@ -28,6 +28,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "fs/types/elf.h"
 #include "fs/vfs.h"
 #include "memory/heap.h"
+#include "memory/heapprof.h"
 #include "memory/vmm.h"
 #include "process/task.h"
 
@@ -42,6 +43,18 @@ void syscall_handler(syscalls_registers_x86_64_t* regs) {
     uint64_t arg5 = regs->rdi;
 
     switch (regs->rax) {
+        case SYS_FORK: {
+            if (unlikely(current_task->privilege == PRIV_KERNEL)) {
+                regs->rax = SYS_ERROR;
+                break;
+            }
+
+            // The child resumes from this same syscall, where it returns 0 instead
+            task* child = fork_elf(current_task, regs);
+            regs->rax = child ? child->id : (uint64_t) SYS_ERROR;
+            break;
+        }
+
         case SYS_DIRSCAN: {
             FileData* buf = (FileData*) arg2;
             size_t count  = (size_t) arg3;
@@ -61,7 +74,7 @@ void syscall_handler(syscalls_registers_x86_64_t* regs) {
                 strncpy(buf[i].name, head->file.name, SYSCALL_FILENAME_LEN - 1);
 
                 temp = head->next;
-                kfree(head);
+                fs_free_node(head);
                 head = temp;
 
                 total_count++;
@@ -72,7 +85,7 @@ void syscall_handler(syscalls_registers_x86_64_t* regs) {
             // Cleanup unused nodes
             while (head) {
                 temp = head->next;
-                kfree(head);
+                fs_free_node(head);
                 head = temp;
             }
 
@@ -324,6 +337,58 @@ void syscall_handler(syscalls_registers_x86_64_t* regs) {
             break;
         }
 
+        case SYS_HEAP_PROFILE: {
+            if (unlikely(current_task->privilege != PRIV_SUPER)) {
+                regs->rax = SYS_ERROR;
+                break;
+            }
+
+            HeapProfData* buf = (HeapProfData*) arg1;
+            uint32_t max_entries = (uint32_t) arg2;
+
+            if (max_entries > HEAP_PROF_TOP_MAX) max_entries = HEAP_PROF_TOP_MAX;
+
+            HeapProfSite sites[HEAP_PROF_TOP_MAX];
+            uint32_t count = heap_prof_top(sites, max_entries);
+
+            for (uint32_t i = 0; i < count; i++) {
+                buf[i].caller     = sites[i].caller;
+                buf[i].allocs     = sites[i].allocs;
+                buf[i].live_count = sites[i].live_count;
+                buf[i].live_bytes = sites[i].live_bytes;
+                buf[i].peak_bytes = sites[i].peak_bytes;
+            }
+
+            regs->rax = count;
+            break;
+        }
+
+        case SYS_GET_HEAP_STATS: {
+            if (unlikely(current_task->privilege != PRIV_SUPER)) {
+                regs->rax = SYS_ERROR;
+                break;
+            }
+
+            HeapStatsData* buf = (HeapStatsData*) arg1;
+
+            HeapStats stats;
+            heap_get_stats(&stats);
+
+            buf->total    = stats.total;
+            buf->used     = stats.used;
+            buf->segments = stats.segments;
+            buf->vmalloc  = stats.vmalloc;
+            buf->allocs   = stats.allocs;
+            buf->frees    = stats.frees;
+
+            for (uint32_t i = 0; i < SYSCALL_HEAP_CLASSES && i < HEAP_CLASS_COUNT; i++) {
+                buf->class_allocs[i] = stats.class_allocs[i];
+            }
+
+            regs->rax = SYS_DONE;
+            break;
+        }
+
         default: {
             err_printf("Unknown syscall (%s): %d", current_task->name, regs->rax);
             err_printf(" | RBX: %llx RCX: %llx RDX: %llx", arg1, arg2, arg3);
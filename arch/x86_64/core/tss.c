@@ -36,7 +36,7 @@ TSSEntry tss_entry;
 void load_tss();
 
 void init_tss(uint32_t idx, uint32_t kss, uint64_t krsp) {
-    uint64_t base = (uint64_t) PHYSICAL_TO_VIRTUAL(&tss_entry);
+    uint64_t base = (uint64_t) &tss_entry;
     uint32_t limit = sizeof(TSSEntry) - 1;
 
     memset(&tss_entry, 0, sizeof(TSSEntry));
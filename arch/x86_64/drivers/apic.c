@@ -130,6 +130,7 @@ static void parse_madt(ACPI_TABLE_MADT* madt) {
             // Check if the core is enabled and we have space in the array
             if ((core->LapicFlags & ACPI_MADT_ENABLED) && (core_count < MAX_CORES)) {
                 core_apic_ids[core_count] = core->Id;
+                core_apic_index[core->Id] = core_count;
                 core_count++;
             }
         }
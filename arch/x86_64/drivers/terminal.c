@@ -32,6 +32,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "drivers/keyboard.h"
 #include "drivers/mouse.h"
 #include "memory/heap.h"
+#include "memory/slab.h"
 #include "memory/vmm.h"
 #include "process/task.h"
 
@@ -61,6 +62,8 @@ size_t    cursor_y;
 uint8_t   terminal_color;
 uint16_t* terminal_buffer = (uint16_t*) PHYSICAL_TO_VIRTUAL(VGA_MEMORY);
 
+static KmemCache* cmd_cache = NULL;
+
 TerminalCmd*  cmd_current_line  = NULL;
 TerminalCmd*  cmd_history_head  = NULL;
 TerminalCmd*  cmd_history_tail  = NULL;
@@ -78,6 +81,8 @@ bool special_char_mode = false;
 char special_char_buffer[MAX_SPECIAL_CHAR_LEN] = "";
 
 void init_terminal() {
+    cmd_cache = kmem_cache_create("TerminalCmd", sizeof(TerminalCmd), 32, NULL);
+
     cursor_x = 0;
     cursor_y = 0;
 	terminal_color = terminal_color_entry(VGA_COLOR_LIGHT_GREY, VGA_COLOR_BLACK);
@@ -248,7 +253,8 @@ void scroll_down() {
 }
 
 void save_cmd_to_history(const char* command) {
-    TerminalCmd* newNode = (TerminalCmd*) kmalloc(sizeof(TerminalCmd));
+    TerminalCmd* newNode = (TerminalCmd*) kmem_cache_alloc(cmd_cache);
+    if (unlikely(!newNode)) return;
     memset(newNode, 0, sizeof(TerminalCmd));
 
     newNode->command = (const char*) strdup(command);
@@ -273,7 +279,7 @@ void save_cmd_to_history(const char* command) {
         }
 
         kfree((void*) toDelete->command);
-        kfree(toDelete);
+        kmem_cache_free(cmd_cache, toDelete);
 
         cmd_history_count--;
     }
@@ -99,6 +99,13 @@ static inline uint64_t asm_get_random(uint8_t *success) {
     return random_val;
 }
 
+/* Assembly cpuid instruction, for leaf `leaf` and sub-leaf `subleaf` */
+static inline void cpu_cpuid(uint32_t leaf, uint32_t subleaf, uint32_t* eax, uint32_t* ebx, uint32_t* ecx, uint32_t* edx) {
+    asm volatile("cpuid"
+        : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+        : "a"(leaf), "c"(subleaf));
+}
+
 /* Assembly CPU memory barrier instruction */
 static inline void cpu_mem_barrier() {
     asm volatile("" : : : "memory");
@@ -22,9 +22,13 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <stddef.h>
 #include <stdint.h>
 
+#include "klib/string.h"
+
+#include "hal.h"
 #include "multiboot.h"
 
 #include "cpu/multicore.h"
+#include "drivers/acpi/acpi.h"
 
 #include "memory/pmm.h"
 #include "memory/vmm.h"
@@ -32,28 +36,208 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define FULL_MASK  0xFFFFFFFFFFFFFFFFULL
 #define IS_FULL(i) (pmm_bitmap[i] == FULL_MASK)
 
+#define PMM_WORD_ALIGN  4096      // Bitmap words per top level word, so every level divides evenly
+#define PMM_MAX_REGIONS 64        // Usable memory map entries looked at
+#define PMM_META_LIMIT  0x40000000 // Metadata sits in the 1 GB that boot.s direct maps
+#define PMM_BIOS_END    0x100000  // First 1 MB: IVT, BIOS data and legacy hardware
+
+#define PMM_CACHE_SIZE  64 // Frames a core's cache holds at most
+#define PMM_CACHE_BATCH 32 // Frames moved between a core's cache and the bitmap at once
+
+#define PMM_NO_NODE     0xFF
+#define PMM_NUMA_LOCAL  10 // SLIT distance from a node to itself
+#define PMM_NUMA_REMOTE 20 // Distance assumed between nodes when there is no SLIT
+
 // Defined in scripts/linker.ld
 extern char _kernel_start;
 extern char _kernel_end;
 
 extern multiboot_info* mbi;
 
-static uint64_t pmm_bitmap[PMM_BITMAP_SIZE];
+// The bitmap, its summaries and the buddy maps all live in one run of pages
+// picked at boot, sized for the highest usable address in the memory map.
+static uint64_t* pmm_bitmap = NULL;
+static uint64_t  pmm_words  = 0; // Bitmap words, a multiple of PMM_WORD_ALIGN
+static uint64_t  pmm_pages  = 0; // Pages the bitmap covers, pmm_words * 64
+
+static uint64_t pmm_meta_start = 0; // Physical range of the metadata
+static uint64_t pmm_meta_size  = 0;
+
+// Frame descriptors, in a run of pages of their own. They cover pages 0 to
+// pmm_page_count, which is all of pmm_pages unless there was no room for that.
+static Page*    pmm_page_array = NULL;
+static uint64_t pmm_page_count = 0;
+static uint64_t pmm_array_start = 0;
+static uint64_t pmm_array_size  = 0;
+
+// Bit i of pmm_summary[s] is set when pmm_bitmap[s * 64 + i] is full, and bit j
+// of pmm_top[t] when pmm_summary[t * 64 + j] is, so a free page is found with a
+// handful of word lookups no matter how much of memory is already in use.
+static uint64_t* pmm_summary   = NULL;
+static uint64_t* pmm_top       = NULL;
+static uint64_t  pmm_top_words = 0;
+
+static uint64_t pmm_hint        = 0; // Bitmap word the last page came from
+static size_t   pmm_free_count  = 0;
+static size_t   pmm_total_count = 0;
+
+/*
+The buddy allocator's free areas, one per order from 1 up. Bit i of an order's
+map is set when block i of that order (pages i << order to (i + 1) << order) is
+free, and is not part of a bigger free block. Each map has the same two summary
+levels as the bitmap, except that they mark words with any bit set. Order 0
+blocks are just free pages, so they are found in pmm_bitmap and only counted.
+*/
+typedef struct {
+    uint64_t* bits;
+    uint64_t* summary;
+    uint64_t* top;
+    uint64_t  top_words;
+} PmmFreeArea;
+
+#define PMM_NO_BLOCK 0xFFFFFFFFFFFFFFFFULL
+
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+} PmmRegion;
+
+// The usable memory map regions, kept past boot since the map itself is not
+static PmmRegion pmm_usable[PMM_MAX_REGIONS];
+static uint32_t  pmm_usable_count = 0;
+
+static PmmFreeArea pmm_free_area[PMM_MAX_ORDER + 1];
+static size_t      pmm_free_blocks[PMM_MAX_ORDER + 1];
 
-static spinlock pmm_lock = 0;
+/*
+Per-core cache of free frames, so single page allocations and frees stay on the
+core and skip pmm_lock. Cached frames are still marked used in the bitmap. The
+owning core takes the cache's own lock with interrupts off, which only ever
+contends when another core drains every cache to find contiguous memory.
+The cache lock is always taken before pmm_lock.
+*/
+typedef struct {
+    uint64_t pages[PMM_CACHE_SIZE];
+    uint32_t count;
+    spinlock lock;
+} __attribute__((aligned(64))) PmmFrameCache;
+
+static PmmFrameCache pmm_caches[MAX_CORES];
+
+static spinlock pmm_lock = 0; // Always taken with interrupts off, since page faults allocate frames
+
+/*
+NUMA layout from the ACPI SRAT. Each proximity domain is given a node number
+in the order the SRAT first mentions it, and the memory affinity entries
+become ranges of pages tagged with their node. With a single node, which is
+also what we have without an SRAT, none of this is looked at and the PMM
+stays one flat pool.
+*/
+typedef struct {
+    uint64_t start; // First page
+    uint64_t end;   // Page after the last
+    uint32_t node;
+} PmmNumaRange;
+
+static PmmNumaRange pmm_numa_ranges[PMM_MAX_REGIONS];
+static uint32_t     pmm_numa_range_count = 0;
+
+static uint32_t pmm_node_count = 1;
+static uint32_t pmm_node_domain[PMM_MAX_NODES];                // ACPI proximity domain of each node
+static uint64_t pmm_node_pages[PMM_MAX_NODES];                 // Pages of each node the PMM manages
+static uint64_t pmm_node_hint[PMM_MAX_NODES];                  // Bitmap word each node last gave a page from
+static uint8_t  pmm_node_order[PMM_MAX_NODES][PMM_MAX_NODES];  // Every node, nearest first, as seen from each node
+static uint8_t  pmm_apic_node[256];                            // Node of each LAPIC ID
+
+/* Bring the summary levels in line with bitmap word `index` */
+static inline void pmm_update_summary(uint64_t index) {
+    uint64_t s = index >> 6;
+    uint64_t t = s >> 6;
+
+    if (IS_FULL(index)) pmm_summary[s] |=  (1ULL << (index & 63));
+    else                pmm_summary[s] &= ~(1ULL << (index & 63));
+
+    if (pmm_summary[s] == FULL_MASK) pmm_top[t] |=  (1ULL << (s & 63));
+    else                             pmm_top[t] &= ~(1ULL << (s & 63));
+}
 
 /* Mark a page as USED (1) */
 static inline void pmm_set_bit(uint64_t page_number) {
     uint64_t index = page_number >> 6;
     uint64_t bit   = page_number & 63;
+
+    if (unlikely(pmm_bitmap[index] & (1ULL << bit))) return;
+
     pmm_bitmap[index] |= (1ULL << bit);
+    pmm_free_count--;
+
+    if (IS_FULL(index)) pmm_update_summary(index);
 }
 
 /* Mark a page as FREE (0) */
 static inline void pmm_clear_bit(uint64_t page_number) {
     uint64_t index = page_number >> 6;
     uint64_t bit   = page_number & 63;
+
+    if (unlikely(!(pmm_bitmap[index] & (1ULL << bit)))) return;
+
+    bool was_full = IS_FULL(index);
+
     pmm_bitmap[index] &= ~(1ULL << bit);
+    pmm_free_count++;
+
+    if (was_full) pmm_update_summary(index);
+}
+
+/* Mark `count` pages from `page` as USED, a word at a time */
+static void pmm_set_range(uint64_t page, uint64_t count) {
+    while (count > 0) {
+        uint64_t index = page >> 6;
+        uint64_t bit   = page & 63;
+        uint64_t n     = (64 - bit < count) ? 64 - bit : count;
+        uint64_t mask  = (n == 64) ? FULL_MASK : ((1ULL << n) - 1) << bit;
+
+        pmm_free_count -= n - __builtin_popcountll(pmm_bitmap[index] & mask);
+        pmm_bitmap[index] |= mask;
+        pmm_update_summary(index);
+
+        page  += n;
+        count -= n;
+    }
+}
+
+/* Mark `count` pages from `page` as FREE, a word at a time */
+static void pmm_clear_range(uint64_t page, uint64_t count) {
+    while (count > 0) {
+        uint64_t index = page >> 6;
+        uint64_t bit   = page & 63;
+        uint64_t n     = (64 - bit < count) ? 64 - bit : count;
+        uint64_t mask  = (n == 64) ? FULL_MASK : ((1ULL << n) - 1) << bit;
+
+        pmm_free_count += __builtin_popcountll(pmm_bitmap[index] & mask);
+        pmm_bitmap[index] &= ~mask;
+        pmm_update_summary(index);
+
+        page  += n;
+        count -= n;
+    }
+}
+
+/* True if every one of `count` pages from `page` is in use */
+static bool pmm_range_used(uint64_t page, uint64_t count) {
+    while (count > 0) {
+        uint64_t index = page >> 6;
+        uint64_t bit   = page & 63;
+        uint64_t n     = (64 - bit < count) ? 64 - bit : count;
+        uint64_t mask  = (n == 64) ? FULL_MASK : ((1ULL << n) - 1) << bit;
+
+        if ((pmm_bitmap[index] & mask) != mask) return false;
+
+        page  += n;
+        count -= n;
+    }
+
+    return true;
 }
 
 /* Check if a page is in use */
@@ -64,84 +248,795 @@ static inline bool pmm_test_bit(uint64_t page_number) {
 }
 
 /*
-Initialise PMM and set the bitmap on the pages for the multiboot, kernel (so that
-we don't overwrite the kernel during runtime), and the bitmask itself.
+Find a bitmap word with a free page in it, or pmm_words if memory is full.
+The word the last page came from is tried first, then the top level is walked
+round from there, so allocations keep moving forward instead of rescanning the
+low pages that were handed out first.
 */
-void init_pmm() {
-    if (unlikely(!(mbi->flags & (1 << 6)))) return;
+static inline uint64_t pmm_find_free_word() {
+    if (likely(pmm_hint < pmm_words && !IS_FULL(pmm_hint))) return pmm_hint;
+
+    uint64_t start = pmm_hint >> 12;
+
+    for (uint64_t n = 0; n < pmm_top_words; n++) {
+        uint64_t t = start + n;
+        if (t >= pmm_top_words) t -= pmm_top_words;
+
+        if (likely(pmm_top[t] == FULL_MASK)) continue;
+
+        uint64_t s = (t << 6) | __builtin_ctzll(~pmm_top[t]);
+        return (s << 6) | __builtin_ctzll(~pmm_summary[s]);
+    }
 
-    // Start by marking everything as used (1)
-    for (int i = 0; i < PMM_BITMAP_SIZE; i++) pmm_bitmap[i] = FULL_MASK;
+    return pmm_words;
+}
+
+/* Bits `first` to `last` of the 64 starting at `base`, clipped to that word */
+static inline uint64_t pmm_span_mask(uint64_t base, uint64_t first, uint64_t last) {
+    uint64_t from = (first > base) ? first - base : 0;
+    uint64_t to   = (last < base + 63) ? last - base : 63;
+
+    return (FULL_MASK << from) & (FULL_MASK >> (63 - to));
+}
+
+/*
+First wanted bit from `lo` up to (not including) `hi` in a three level map:
+`bits`, a `summary` bit per word of it and a `top` bit per summary word. Bits
+are wanted when clear if `flip` is FULL_MASK (the bitmap, where the levels
+above mark full words), or when set if it is 0 (the buddy maps, where they
+mark words that are not empty). Returns PMM_NO_BLOCK if there is none.
+*/
+static uint64_t pmm_scan_levels(const uint64_t* top, const uint64_t* summary, const uint64_t* bits,
+                                uint64_t flip, uint64_t lo, uint64_t hi) {
+    if (unlikely(lo >= hi)) return PMM_NO_BLOCK;
+
+    uint64_t w_lo = lo >> 6,   w_hi = (hi - 1) >> 6;
+    uint64_t s_lo = w_lo >> 6, s_hi = w_hi >> 6;
+
+    for (uint64_t t = s_lo >> 6; t <= (s_hi >> 6); t++) {
+        uint64_t top_mask = (top[t] ^ flip) & pmm_span_mask(t << 6, s_lo, s_hi);
+
+        while (top_mask) {
+            uint64_t s = (t << 6) | __builtin_ctzll(top_mask);
+            top_mask &= top_mask - 1;
+
+            uint64_t summary_mask = (summary[s] ^ flip) & pmm_span_mask(s << 6, w_lo, w_hi);
+
+            while (summary_mask) {
+                uint64_t w = (s << 6) | __builtin_ctzll(summary_mask);
+                summary_mask &= summary_mask - 1;
+
+                uint64_t mask = (bits[w] ^ flip) & pmm_span_mask(w << 6, lo, hi - 1);
+                if (mask) return (w << 6) | __builtin_ctzll(mask);
+            }
+        }
+    }
+
+    return PMM_NO_BLOCK;
+}
+
+/* Node the running core belongs to */
+static inline uint32_t pmm_local_node() {
+    if (likely(pmm_node_count <= 1)) return 0;
+    return pmm_apic_node[core_apic_ids[get_core_id()]];
+}
+
+/* Node a page belongs to, or PMM_NO_NODE if the SRAT does not cover it */
+static uint32_t pmm_page_node(uint64_t page) {
+    for (uint32_t i = 0; i < pmm_numa_range_count; i++) {
+        if (page >= pmm_numa_ranges[i].start && page < pmm_numa_ranges[i].end) return pmm_numa_ranges[i].node;
+    }
+
+    return PMM_NO_NODE;
+}
+
+/*
+Find a bitmap word with a free page in it for a core on `node`: the word that
+node last took from, then the node's own ranges, then those of the other
+nodes from nearest to furthest, and finally anything the SRAT left out.
+Returns pmm_words if memory is full.
+*/
+static uint64_t pmm_find_free_word_near(uint32_t node) {
+    uint64_t hint = pmm_node_hint[node];
+    if (likely(hint < pmm_words && !IS_FULL(hint))) return hint;
+
+    for (uint32_t n = 0; n < pmm_node_count; n++) {
+        uint32_t near = pmm_node_order[node][n];
+
+        for (uint32_t i = 0; i < pmm_numa_range_count; i++) {
+            if (pmm_numa_ranges[i].node != near) continue;
+
+            uint64_t page = pmm_scan_levels(pmm_top, pmm_summary, pmm_bitmap, FULL_MASK,
+                                            pmm_numa_ranges[i].start, pmm_numa_ranges[i].end);
+            if (page != PMM_NO_BLOCK) return page >> 6;
+        }
+    }
+
+    uint64_t page = pmm_scan_levels(pmm_top, pmm_summary, pmm_bitmap, FULL_MASK, 0, pmm_pages);
+    return (page == PMM_NO_BLOCK) ? pmm_words : (page >> 6);
+}
+
+/* Number of free pages from `page` to `end`, a word at a time */
+static uint64_t pmm_count_free(uint64_t page, uint64_t end) {
+    uint64_t free = 0;
+
+    while (page < end) {
+        uint64_t w    = page >> 6;
+        uint64_t mask = pmm_span_mask(w << 6, page, end - 1);
+
+        free += __builtin_popcountll(~pmm_bitmap[w] & mask);
+        page  = (w + 1) << 6;
+    }
+
+    return free;
+}
+
+/* Descriptor of page `page_number`, or NULL if it has none */
+static inline Page* pmm_desc(uint64_t page_number) {
+    return likely(page_number < pmm_page_count) ? &pmm_page_array[page_number] : NULL;
+}
+
+/* Set up the descriptors of `count` pages that have just been handed out */
+static inline void pmm_claim_descs(uint64_t page, uint64_t count) {
+    for (uint64_t i = page; i < page + count && i < pmm_page_count; i++) {
+        pmm_page_array[i] = (Page) { .refcount = 1 };
+    }
+}
 
-    // Protect multiboot
+/* Check if `block` is a free block of `order` (1 and up) */
+static inline bool buddy_test(uint32_t order, uint64_t block) {
+    return pmm_free_area[order].bits[block >> 6] & (1ULL << (block & 63));
+}
+
+/* Add a free block to its order. Order 0 blocks are only counted. */
+static inline void buddy_insert(uint32_t order, uint64_t block) {
+    pmm_free_blocks[order]++;
+    if (order == 0) return;
+
+    PmmFreeArea* area = &pmm_free_area[order];
+    uint64_t w = block >> 6;
+    uint64_t s = w >> 6;
+
+    area->bits[w]       |= (1ULL << (block & 63));
+    area->summary[s]    |= (1ULL << (w & 63));
+    area->top[s >> 6]   |= (1ULL << (s & 63));
+}
+
+/* Take a free block out of its order */
+static inline void buddy_remove(uint32_t order, uint64_t block) {
+    pmm_free_blocks[order]--;
+    if (order == 0) return;
+
+    PmmFreeArea* area = &pmm_free_area[order];
+    uint64_t w = block >> 6;
+    uint64_t s = w >> 6;
+
+    area->bits[w] &= ~(1ULL << (block & 63));
+    if (area->bits[w] != 0) return;
+
+    area->summary[s] &= ~(1ULL << (w & 63));
+    if (area->summary[s] != 0) return;
+
+    area->top[s >> 6] &= ~(1ULL << (s & 63));
+}
+
+/* Any free block of `order` (1 and up), or PMM_NO_BLOCK */
+static inline uint64_t buddy_find(uint32_t order) {
+    PmmFreeArea* area = &pmm_free_area[order];
+
+    for (uint64_t t = 0; t < area->top_words; t++) {
+        if (likely(area->top[t] == 0)) continue;
+
+        uint64_t s = (t << 6) | __builtin_ctzll(area->top[t]);
+        uint64_t w = (s << 6) | __builtin_ctzll(area->summary[s]);
+        return (w << 6) | __builtin_ctzll(area->bits[w]);
+    }
+
+    return PMM_NO_BLOCK;
+}
+
+/*
+A free page is about to be handed out on its own. Find the free block holding
+it and split that block down, giving back every half the page is not in.
+*/
+static void buddy_take_page(uint64_t page) {
+    for (uint32_t order = PMM_MAX_ORDER; order > 0; order--) {
+        if (!buddy_test(order, page >> order)) continue;
+
+        buddy_remove(order, page >> order);
+
+        while (order-- > 0) {
+            buddy_insert(order, (page >> order) ^ 1);
+        }
+
+        return;
+    }
+
+    buddy_remove(0, page);
+}
+
+/*
+The pages of `block` have just been freed. Merge it with its buddy for as long
+as the buddy is a free block of the same order, then file the result.
+*/
+static void buddy_give(uint64_t block, uint32_t order) {
+    while (order < PMM_MAX_ORDER) {
+        uint64_t buddy = block ^ 1;
+
+        // The block was in use until now, so a free buddy page is a whole order 0 block
+        bool free = (order == 0) ? !pmm_test_bit(buddy) : buddy_test(order, buddy);
+        if (!free) break;
+
+        buddy_remove(order, buddy);
+
+        block >>= 1;
+        order++;
+    }
+
+    buddy_insert(order, block);
+}
+
+/* Largest order a block starting at `page` and no longer than `count` pages can have */
+static inline uint32_t buddy_fit(uint64_t page, uint64_t count) {
+    uint32_t order = 63 - __builtin_clzll(count);
+
+    if (page != 0 && (uint32_t) __builtin_ctzll(page) < order) order = __builtin_ctzll(page);
+    if (order > PMM_MAX_ORDER) order = PMM_MAX_ORDER;
+
+    return order;
+}
+
+/*
+Free every used page of a range, as the biggest aligned blocks that fit, so
+the blocks merge in as few steps as possible. Pages that are already free are
+skipped. The PMM lock must be held.
+*/
+static void pmm_release_range(uint64_t page, uint64_t count) {
+    while (count > 0) {
+        uint32_t order = buddy_fit(page, count);
+        uint64_t size  = 1ULL << order;
+
+        if (likely(pmm_range_used(page, size))) {
+            pmm_clear_range(page, size);
+            buddy_give(page >> order, order);
+        } else {
+            for (uint64_t i = page; i < page + size; i++) {
+                if (!pmm_test_bit(i)) continue;
+
+                pmm_clear_bit(i);
+                buddy_give(i, 0);
+            }
+        }
+
+        page  += size;
+        count -= size;
+    }
+}
+
+/*
+Take free `block` of order `j` out of the buddy allocator, split it down to
+`order` and mark the first piece used. Returns its first page.
+*/
+static uint64_t buddy_split(uint32_t j, uint64_t block, uint32_t order) {
+    buddy_remove(j, block);
+
+    while (j > order) {
+        j--;
+        block <<= 1;
+        buddy_insert(j, block | 1);
+    }
+
+    uint64_t page = block << order;
+    pmm_set_range(page, 1ULL << order);
+
+    return page;
+}
+
+/*
+Like buddy_alloc, but only from blocks that lie wholly inside one node, going
+through the nodes from nearest to furthest from `node`.
+*/
+static uint64_t buddy_alloc_near(uint32_t order, uint32_t node) {
+    for (uint32_t n = 0; n < pmm_node_count; n++) {
+        uint32_t near = pmm_node_order[node][n];
+
+        for (uint32_t j = order; j <= PMM_MAX_ORDER; j++) {
+            if (pmm_free_blocks[j] == 0) continue;
+
+            PmmFreeArea* area = &pmm_free_area[j];
+
+            for (uint32_t i = 0; i < pmm_numa_range_count; i++) {
+                if (pmm_numa_ranges[i].node != near) continue;
+
+                uint64_t lo = (pmm_numa_ranges[i].start + (1ULL << j) - 1) >> j;
+                uint64_t hi = pmm_numa_ranges[i].end >> j;
+
+                uint64_t block = pmm_scan_levels(area->top, area->summary, area->bits, 0, lo, hi);
+                if (block != PMM_NO_BLOCK) return buddy_split(j, block, order);
+            }
+        }
+    }
+
+    return PMM_NO_BLOCK;
+}
+
+/*
+Allocate a block of 2^order pages, aligned to its own size, from the smallest
+order that has one, splitting it down on the way. On a NUMA machine the
+running core's node is tried first. Returns the first page, or PMM_NO_BLOCK.
+The PMM lock must be held.
+*/
+static uint64_t buddy_alloc(uint32_t order) {
+    if (unlikely(pmm_node_count > 1)) {
+        uint64_t page = buddy_alloc_near(order, pmm_local_node());
+        if (likely(page != PMM_NO_BLOCK)) return page;
+    }
+
+    for (uint32_t j = order; j <= PMM_MAX_ORDER; j++) {
+        if (pmm_free_blocks[j] == 0) continue;
+
+        uint64_t block = buddy_find(j);
+        if (unlikely(block == PMM_NO_BLOCK)) continue;
+
+        return buddy_split(j, block, order);
+    }
+
+    return PMM_NO_BLOCK;
+}
+
+/*
+Lay the bitmap, its summaries and every order's free area out from `base`, for
+a bitmap of `words` words. With a NULL base nothing is laid out. Either way,
+returns the number of words it all takes.
+*/
+static uint64_t pmm_layout(uint64_t* base, uint64_t words) {
+    uint64_t size = words + words / 64 + words / PMM_WORD_ALIGN;
+
+    if (base != NULL) {
+        pmm_bitmap    = base;
+        pmm_summary   = pmm_bitmap + words;
+        pmm_top       = pmm_summary + words / 64;
+        pmm_top_words = words / PMM_WORD_ALIGN;
+    }
+
+    for (uint32_t order = 1; order <= PMM_MAX_ORDER; order++) {
+        uint64_t bit_words     = words >> order;
+        uint64_t summary_words = (bit_words + 63) / 64;
+        uint64_t top_words     = (summary_words + 63) / 64;
+
+        if (base != NULL) {
+            PmmFreeArea* area = &pmm_free_area[order];
+
+            area->bits      = base + size;
+            area->summary   = area->bits + bit_words;
+            area->top       = area->summary + summary_words;
+            area->top_words = top_words;
+        }
+
+        size += bit_words + summary_words + top_words;
+    }
+
+    return size;
+}
+
+/*
+Fill the free areas from the finished bitmap. Every run of free pages is cut
+into the biggest aligned blocks that fit, which are already as merged as they
+can be, since the pages either side of a run are in use.
+*/
+static void init_buddy() {
+    uint64_t limit = pmm_pages;
+    uint64_t page  = 0;
+
+    while (page < limit) {
+        if ((page & 63) == 0 && IS_FULL(page >> 6)) {
+            page += 64;
+            continue;
+        }
+
+        if (pmm_test_bit(page)) {
+            page++;
+            continue;
+        }
+
+        uint64_t start = page;
+
+        while (page < limit && !pmm_test_bit(page)) {
+            if ((page & 63) == 0 && pmm_bitmap[page >> 6] == 0) page += 64;
+            else                                                page++;
+        }
+
+        for (uint64_t run = start; run < page;) {
+            uint32_t order = buddy_fit(run, page - run);
+            buddy_insert(order, run >> order);
+            run += 1ULL << order;
+        }
+    }
+}
+
+/*
+Every page the finished bitmap has as used never came from the allocator, so
+its descriptor is marked reserved, with the one reference whoever frees it
+(like kill_bootstrap) will drop.
+*/
+static void init_page_array() {
+    for (uint64_t w = 0; w < pmm_page_count / 64; w++) {
+        uint64_t used = pmm_bitmap[w];
+
+        while (used) {
+            Page* page = &pmm_page_array[(w << 6) | __builtin_ctzll(used)];
+            used &= used - 1;
+
+            page->refcount = 1;
+            page->flags    = PAGE_FLAG_RESERVED;
+        }
+    }
+}
+
+/* Collect the usable RAM regions of the multiboot memory map, page aligned inwards */
+static uint32_t pmm_usable_regions(PmmRegion* regions, uint32_t max) {
     multiboot_mmap_entry* mmap = (multiboot_mmap_entry*)((uintptr_t) PHYSICAL_TO_VIRTUAL(mbi->mmap_addr));
     uintptr_t mmap_end = (uintptr_t) mmap + mbi->mmap_length;
 
-    while ((uintptr_t) mmap < mmap_end) {
+    uint32_t count = 0;
+
+    while ((uintptr_t) mmap < mmap_end && count < max) {
         uint32_t entry_size = *(uint32_t*)((uintptr_t) mmap - 4);
+
         if (mmap->type == 1) {
-            uint64_t start_page  = mmap->addr / PAGE_SIZE;
-            uint64_t total_pages = mmap->len  / PAGE_SIZE;
+            uint64_t start = (mmap->addr + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+            uint64_t end   = (mmap->addr + mmap->len) & ~(uint64_t)(PAGE_SIZE - 1);
 
-            for (uint64_t i = start_page; i < total_pages + start_page; i++) {
-                if (likely(i < (uint64_t) PMM_BITMAP_SIZE * 64)) {
-                    pmm_clear_bit(i);
-                }
+            if (end > start) {
+                regions[count].start = start;
+                regions[count].end   = end;
+                count++;
             }
         }
 
         mmap = (multiboot_mmap_entry*)((uintptr_t) mmap + entry_size + 4);
     }
 
+    return count;
+}
+
+/*
+Find `size` bytes of usable RAM for the PMM's metadata, clear of everything
+still in use at boot (including any metadata already placed), and below
+PMM_META_LIMIT so it can be reached before init_vmm maps the rest of RAM.
+Returns 0 if there is no such room.
+*/
+static uint64_t pmm_place_meta(const PmmRegion* regions, uint32_t count, uint64_t size) {
+    const PmmRegion busy[] = {
+        { 0,                                (uint64_t) PMM_BIOS_END },
+        { (uintptr_t) &_kernel_start,       (uintptr_t) &_kernel_end },
+        { VIRTUAL_TO_PHYSICAL(mbi),         VIRTUAL_TO_PHYSICAL(mbi) + sizeof(multiboot_info) },
+        { mbi->mmap_addr,                   (uint64_t) mbi->mmap_addr + mbi->mmap_length },
+        { pmm_meta_start,                   pmm_meta_start + pmm_meta_size },
+    };
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t start = regions[i].start;
+        uint64_t end   = (regions[i].end < PMM_META_LIMIT) ? regions[i].end : PMM_META_LIMIT;
+
+        bool moved = true;
+        while (moved) {
+            moved = false;
+
+            for (uint32_t b = 0; b < sizeof(busy) / sizeof(busy[0]); b++) {
+                if (start < busy[b].end && busy[b].start < start + size) {
+                    start = (busy[b].end + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+                    moved = true;
+                }
+            }
+        }
+
+        if (start + size <= end) return start;
+    }
+
+    return 0;
+}
+
+/*
+Initialise PMM and set the bitmap on the pages for the multiboot, kernel (so that
+we don't overwrite the kernel during runtime), and the bitmask itself.
+
+The bitmap only covers memory up to the highest usable address in the memory
+map, and is built a word at a time, so setting it up takes time in proportion
+to the RAM there is rather than to the largest machine we could run on.
+*/
+void init_pmm() {
+    if (unlikely(!(mbi->flags & (1 << 6)))) return;
+
+    PmmRegion regions[PMM_MAX_REGIONS];
+    uint32_t  region_count = pmm_usable_regions(regions, PMM_MAX_REGIONS);
+
+    memcpy(pmm_usable, regions, region_count * sizeof(PmmRegion));
+    pmm_usable_count = region_count;
+
+    uint64_t highest = 0;
+    for (uint32_t i = 0; i < region_count; i++) {
+        if (regions[i].end > highest) highest = regions[i].end;
+    }
+
+    uint64_t words = (highest / PAGE_SIZE + 63) / 64;
+    words = (words + PMM_WORD_ALIGN - 1) & ~(uint64_t)(PMM_WORD_ALIGN - 1);
+
+    // If the metadata for all of RAM has nowhere to go, track less of it
+    uint64_t meta = 0;
+    uint64_t size = 0;
+    while (words >= PMM_WORD_ALIGN) {
+        size = pmm_layout(NULL, words) * sizeof(uint64_t);
+        size = (size + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+
+        meta = pmm_place_meta(regions, region_count, size);
+        if (likely(meta != 0)) break;
+
+        words >>= 1;
+    }
+
+    if (unlikely(meta == 0)) return;
+
+    pmm_meta_start = meta;
+    pmm_meta_size  = size;
+    pmm_words      = words;
+    pmm_pages      = words * 64;
+
+    // The frame descriptors are the biggest part, so they give way first: the
+    // pages past what they cover are still allocated, just without one
+    uint64_t covered = pmm_pages;
+    while (covered >= 64) {
+        pmm_array_size  = (covered * sizeof(Page) + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+        pmm_array_start = pmm_place_meta(regions, region_count, pmm_array_size);
+        if (likely(pmm_array_start != 0)) break;
+
+        covered >>= 1;
+    }
+
+    if (likely(pmm_array_start != 0)) {
+        pmm_page_array = (Page*) PHYSICAL_TO_VIRTUAL(pmm_array_start);
+        pmm_page_count = covered;
+        memset(pmm_page_array, 0, pmm_array_size);
+    } else {
+        pmm_array_size = 0;
+    }
+
+    uint64_t* base = (uint64_t*) PHYSICAL_TO_VIRTUAL(pmm_meta_start);
+    pmm_layout(base, pmm_words);
+
+    // Start by marking everything as used (1), with empty buddy maps after it
+    uint64_t bitmap_words = pmm_words + pmm_words / 64 + pmm_top_words;
+    memset(base, 0xFF, bitmap_words * sizeof(uint64_t));
+    memset(base + bitmap_words, 0, pmm_meta_size - bitmap_words * sizeof(uint64_t));
+
+    pmm_free_count = 0;
+
+    for (uint32_t i = 0; i < region_count; i++) {
+        uint64_t start = regions[i].start / PAGE_SIZE;
+        uint64_t end   = regions[i].end   / PAGE_SIZE;
+
+        if (start >= pmm_pages) continue;
+        if (end > pmm_pages) end = pmm_pages;
+
+        pmm_clear_range(start, end - start);
+    }
+
     // Protect the first 1MB / IVT / BIOS areas
-    for (uint64_t i = 0; i < 256; i++) pmm_set_bit(i);
+    pmm_set_range(0, PMM_BIOS_END / PAGE_SIZE);
 
     // Protect Kernel (_kernel_start to _kernel_end)
     uint64_t start_p = (uintptr_t) &_kernel_start / PAGE_SIZE;
     uint64_t end_p   = ((uintptr_t) &_kernel_end + PAGE_SIZE - 1) / PAGE_SIZE;
-    for (uint64_t i = start_p; i <= end_p; i++) pmm_set_bit(i);
+    pmm_set_range(start_p, end_p - start_p);
 
-    // Protect the Bitmap itself
-    uint64_t b_start = VIRTUAL_TO_PHYSICAL(pmm_bitmap) / PAGE_SIZE;
-    uint64_t b_end   = (VIRTUAL_TO_PHYSICAL(pmm_bitmap) + sizeof(pmm_bitmap) + PAGE_SIZE - 1) / PAGE_SIZE;
-    for (uint64_t i = b_start; i <= b_end; i++) pmm_set_bit(i);
+    // Protect the metadata itself
+    pmm_set_range(pmm_meta_start / PAGE_SIZE, pmm_meta_size / PAGE_SIZE);
+    pmm_set_range(pmm_array_start / PAGE_SIZE, pmm_array_size / PAGE_SIZE);
 
     // Protect the entire Multiboot structure block safely
     uint64_t mbi_start_p = VIRTUAL_TO_PHYSICAL(mbi) / PAGE_SIZE;
     uint64_t mbi_end_p   = (VIRTUAL_TO_PHYSICAL(mbi) + sizeof(multiboot_info) + PAGE_SIZE - 1) / PAGE_SIZE;
-    for (uint64_t i = mbi_start_p; i <= mbi_end_p; i++) pmm_set_bit(i);
+    pmm_set_range(mbi_start_p, mbi_end_p - mbi_start_p);
+
+    init_buddy();
+    init_page_array();
+
+    pmm_total_count = pmm_free_count;
+    pmm_hint        = pmm_find_free_word();
+    if (unlikely(pmm_hint == pmm_words)) pmm_hint = 0;
 }
 
-/* Request a 4 KB page from the PMM using a first-fit algorithm. */
-void* pmm_alloc_page() {
-    spin_lock(&pmm_lock);
+/*
+Take up to `count` pages off the bitmap into `pages`, starting from where the
+last one was found, or from the running core's node on a NUMA machine.
+Returns how many it got. The PMM lock must be held.
+*/
+static uint32_t pmm_take_pages(uint64_t* pages, uint32_t count) {
+    uint32_t taken = 0;
+    uint32_t node  = pmm_local_node();
+    bool     numa  = pmm_node_count > 1;
+
+    while (taken < count) {
+        uint64_t i = unlikely(numa) ? pmm_find_free_word_near(node) : pmm_find_free_word();
+        if (unlikely(i == pmm_words)) break;
 
-    for (uint64_t i = 0; i < PMM_BITMAP_SIZE; i++) {
-        if (unlikely(!IS_FULL(i))) {
+        if (unlikely(numa)) pmm_node_hint[node] = i;
+        else                pmm_hint            = i;
+
+        while (taken < count && !IS_FULL(i)) {
             uint64_t page_number = (i << 6) | __builtin_ctzll(~pmm_bitmap[i]);
+            buddy_take_page(page_number);
             pmm_set_bit(page_number);
 
-            spin_unlock(&pmm_lock);
-            return (void*)((uintptr_t) page_number * PAGE_SIZE);
+            pages[taken++] = page_number;
         }
     }
 
-    spin_unlock(&pmm_lock);
-    return NULL;
+    return taken;
+}
+
+/* Put pages back on the bitmap, merging each into the buddy allocator. The PMM lock must be held. */
+static void pmm_give_pages(const uint64_t* pages, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (unlikely(!pmm_test_bit(pages[i]))) continue;
+
+        pmm_clear_bit(pages[i]);
+        buddy_give(pages[i], 0);
+    }
 }
 
 /*
-Iterates through the PMM to find the first continuous block of pages that was
-required, and if none is found, NULL.
+Empty every core's frame cache back into the bitmap, so its pages can merge
+into the bigger blocks a contiguous allocation needs.
 */
-void* pmm_alloc_pages(size_t length) {
-    if (unlikely(length <= 0)) return NULL;
-    if (unlikely(length == 1)) return pmm_alloc_page();
+static void pmm_drain_caches() {
+    uint32_t cores = (core_count > 0) ? core_count : 1;
+
+    for (uint32_t core = 0; core < cores; core++) {
+        PmmFrameCache* cache = &pmm_caches[core];
+
+        uint64_t flags = save_disable_interrupts();
+        spin_lock(&cache->lock);
+        spin_lock(&pmm_lock);
+
+        pmm_give_pages(cache->pages, cache->count);
+        cache->count = 0;
+
+        spin_unlock(&pmm_lock);
+        spin_unlock(&cache->lock);
+        restore_interrupts(flags);
+    }
+}
+
+/*
+Request a 4 KB page from the PMM. It comes off this core's frame cache, which
+is refilled from the bitmap a batch at a time when it runs dry.
+*/
+void* pmm_alloc_page() {
+    uint64_t flags = save_disable_interrupts();
+    PmmFrameCache* cache = &pmm_caches[get_core_id()];
+
+    spin_lock(&cache->lock);
+
+    if (unlikely(cache->count == 0)) {
+        spin_lock(&pmm_lock);
+        cache->count = pmm_take_pages(cache->pages, PMM_CACHE_BATCH);
+        spin_unlock(&pmm_lock);
+    }
+
+    void* page = NULL;
+    if (likely(cache->count > 0)) {
+        uint64_t page_number = cache->pages[--cache->count];
+        pmm_claim_descs(page_number, 1);
+
+        page = (void*)((uintptr_t) page_number * PAGE_SIZE);
+    }
+
+    spin_unlock(&cache->lock);
+    restore_interrupts(flags);
+
+    return page;
+}
+
+/*
+Allocate 2^order physically contiguous pages, aligned to their own size, from
+the buddy allocator. Free them with pmm_free_order at the same order.
+*/
+void* pmm_alloc_order(uint32_t order) {
+    if (unlikely(order > PMM_MAX_ORDER)) return NULL;
+    if (order == 0) return pmm_alloc_page();
+
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+    uint64_t page = buddy_alloc(order);
+    spin_unlock_irqrestore(&pmm_lock, flags);
+
+    // Frames parked in the per-core caches may be all that splits a block
+    if (unlikely(page == PMM_NO_BLOCK)) {
+        pmm_drain_caches();
+
+        flags = spin_lock_irqsave(&pmm_lock);
+        page = buddy_alloc(order);
+        spin_unlock_irqrestore(&pmm_lock, flags);
+    }
+
+    if (unlikely(page == PMM_NO_BLOCK)) return NULL;
+
+    pmm_claim_descs(page, 1ULL << order);
+    return (void*)((uintptr_t) page * PAGE_SIZE);
+}
+
+/*
+Drop a reference on each of the `count` pages from `page`, by the same rules as
+pmm_drop_page, and give back only the pages nobody holds any more. They go back
+a run at a time, so a block nobody shared still merges with its buddies whole.
+*/
+static void pmm_put_range(uint64_t page, uint64_t count) {
+    uint64_t run = page; // First page of the run of freed pages not given back yet
+
+    for (uint64_t i = page; i <= page + count; i++) {
+        bool freed = false;
+
+        if (likely(i < page + count) && pmm_test_bit(i)) {
+            Page* desc = pmm_desc(i);
+
+            if (unlikely(desc == NULL)) {
+                freed = true;
+            } else if (likely(desc->refcount != 0) && __atomic_sub_fetch(&desc->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+                *desc = (Page) { 0 };
+                freed = true;
+            }
+        }
+
+        if (likely(freed)) continue;
+
+        if (i > run) {
+            uint64_t flags = spin_lock_irqsave(&pmm_lock);
+            pmm_release_range(run, i - run);
+            spin_unlock_irqrestore(&pmm_lock, flags);
+        }
+
+        run = i + 1;
+    }
+}
+
+/*
+Give back a block from pmm_alloc_order, merging it with its free buddies. Pages
+of it that are still shared only lose a reference.
+*/
+void pmm_free_order(void* addr, uint32_t order) {
+    uint64_t page = (uintptr_t) addr / PAGE_SIZE;
+    uint64_t size = 1ULL << order;
 
-    spin_lock(&pmm_lock);
+    if (unlikely(order > PMM_MAX_ORDER || (page & (size - 1)) != 0)) return;
+    if (unlikely(page + size > pmm_pages)) return;
+
+    pmm_put_range(page, size);
+}
+
+/*
+Find `length` physically contiguous pages. The smallest buddy block that
+holds them is taken, and the pages past `length` are freed straight back, so
+only the tail of the block is split. Runs too long for the buddy allocator
+fall back to a search of the bitmap.
+*/
+static void* pmm_find_pages(size_t length) {
+    uint32_t order = 64 - __builtin_clzll(length - 1);
+
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+
+    if (likely(order <= PMM_MAX_ORDER)) {
+        uint64_t page = buddy_alloc(order);
+
+        if (likely(page != PMM_NO_BLOCK)) {
+            pmm_release_range(page + length, (1ULL << order) - length);
+
+            spin_unlock_irqrestore(&pmm_lock, flags);
+            return (void*)((uintptr_t) page * PAGE_SIZE);
+        }
+    }
 
-    uint64_t max_bit = (uint64_t) PMM_BITMAP_SIZE * 64;
-    for (uint64_t i = 0; i <= max_bit - length;) {
+    uint64_t max_bit = pmm_pages;
+    for (uint64_t i = 0; i + length <= max_bit;) {
         // Skip quickly if the current bit is set
         if (pmm_test_bit(i)) {
             // If the whole 64-bit chunk is full, skip it safely
@@ -160,20 +1055,12 @@ void* pmm_alloc_pages(size_t length) {
         }
 
         if (pages_found == length) {
-            uint64_t idx = i >> 6;
-            uint64_t bit_offset = i & 63;
-
-            // Check if the whole range fits inside the current 64-bit word
-            if (bit_offset + length <= 64) {
-                pmm_bitmap[idx] |= ((1ULL << length) - 1) << bit_offset;
-            } else {
-                // Spans multiple words
-                for (uint64_t j = i; j < i + length; j++) {
-                    pmm_set_bit(j);
-                }
+            for (uint64_t j = i; j < i + length; j++) {
+                buddy_take_page(j);
+                pmm_set_bit(j);
             }
 
-            spin_unlock(&pmm_lock);
+            spin_unlock_irqrestore(&pmm_lock, flags);
             return (void*)((uintptr_t) i * PAGE_SIZE);
         }
 
@@ -181,16 +1068,338 @@ void* pmm_alloc_pages(size_t length) {
         i += pages_found + 1;
     }
 
-    spin_unlock(&pmm_lock);
+    spin_unlock_irqrestore(&pmm_lock, flags);
     return NULL;
 }
 
-/* Unmark the page from the bitmask, letting another process overwrite it later */
+/* Allocate `length` physically contiguous pages, draining the frame caches if need be */
+void* pmm_alloc_pages(size_t length) {
+    if (unlikely(length == 0)) return NULL;
+    if (unlikely(length == 1)) return pmm_alloc_page();
+
+    void* pages = pmm_find_pages(length);
+
+    if (unlikely(pages == NULL)) {
+        pmm_drain_caches();
+        pages = pmm_find_pages(length);
+    }
+
+    if (likely(pages != NULL)) pmm_claim_descs((uintptr_t) pages / PAGE_SIZE, length);
+    return pages;
+}
+
+/*
+Drop a reference to a page, and free it if that was the last one. Returns true
+if it was freed. A freed frame goes on this core's frame cache, and once that
+is full, the older half of the cache goes back to the bitmap under one lock.
+*/
+static bool pmm_drop_page(uint64_t page_number) {
+    if (unlikely(page_number >= pmm_pages)) return false;
+    if (unlikely(!pmm_test_bit(page_number))) return false; // Already free
+
+    Page* desc = pmm_desc(page_number);
+    if (likely(desc != NULL)) {
+        if (unlikely(desc->refcount == 0)) return false; // Already free, sitting in a frame cache
+        if (__atomic_sub_fetch(&desc->refcount, 1, __ATOMIC_ACQ_REL) != 0) return false;
+
+        *desc = (Page) { 0 };
+    }
+
+    uint64_t flags = save_disable_interrupts();
+
+    // Another node's page goes straight home, so this core's cache only holds local ones
+    if (unlikely(pmm_node_count > 1) && pmm_page_node(page_number) != pmm_local_node()) {
+        spin_lock(&pmm_lock);
+        pmm_give_pages(&page_number, 1);
+        spin_unlock(&pmm_lock);
+
+        restore_interrupts(flags);
+        return true;
+    }
+
+    PmmFrameCache* cache = &pmm_caches[get_core_id()];
+
+    spin_lock(&cache->lock);
+
+    if (unlikely(cache->count == PMM_CACHE_SIZE)) {
+        spin_lock(&pmm_lock);
+        pmm_give_pages(cache->pages, PMM_CACHE_BATCH);
+        spin_unlock(&pmm_lock);
+
+        for (uint32_t i = PMM_CACHE_BATCH; i < PMM_CACHE_SIZE; i++) {
+            cache->pages[i - PMM_CACHE_BATCH] = cache->pages[i];
+        }
+
+        cache->count = PMM_CACHE_SIZE - PMM_CACHE_BATCH;
+    }
+
+    cache->pages[cache->count++] = page_number;
+
+    spin_unlock(&cache->lock);
+    restore_interrupts(flags);
+
+    return true;
+}
+
+/* Give a page back. If the frame is shared, this only drops this holder's reference. */
 void pmm_free_page(void* addr) {
-    uintptr_t address    = (uintptr_t)addr;
-    uint64_t page_number = address / PAGE_SIZE;
+    pmm_drop_page((uintptr_t) addr / PAGE_SIZE);
+}
+
+/* Free `length` pages from `addr`, such as a run from pmm_alloc_pages, one reference each */
+void pmm_free_pages(void* addr, size_t length) {
+    uint64_t page = (uintptr_t) addr / PAGE_SIZE;
+
+    if (unlikely(length == 0 || page + length > pmm_pages)) return;
+
+    pmm_put_range(page, length);
+}
+
+/* Number of pages that are free right now, counting the ones in frame caches */
+size_t pmm_get_free_pages() {
+    size_t free = pmm_free_count;
+
+    for (uint32_t core = 0; core < MAX_CORES; core++) {
+        free += pmm_caches[core].count;
+    }
+
+    return free;
+}
+
+/* Number of usable pages the PMM was given at boot */
+size_t pmm_get_total_pages() {
+    return pmm_total_count;
+}
+
+/* Snapshot of how many free blocks each buddy order holds */
+void pmm_get_buddy_stats(PmmBuddyStats* stats) {
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+
+    stats->free_pages = pmm_free_count;
+    for (uint32_t i = 0; i <= PMM_MAX_ORDER; i++) {
+        stats->free_blocks[i] = pmm_free_blocks[i];
+    }
+
+    spin_unlock_irqrestore(&pmm_lock, flags);
+
+    stats->cached_pages = 0;
+    for (uint32_t core = 0; core < MAX_CORES; core++) {
+        stats->cached_pages += pmm_caches[core].count;
+    }
+}
+
+/* Descriptor of the frame at physical address `addr`, or NULL if it has none */
+Page* pmm_page(void* addr) {
+    uint64_t page_number = (uintptr_t) addr / PAGE_SIZE;
+    return (page_number < pmm_page_count) ? &pmm_page_array[page_number] : NULL;
+}
+
+/* Physical address of the frame a descriptor is for */
+void* pmm_page_addr(Page* page) {
+    return (void*)((uintptr_t)(page - pmm_page_array) * PAGE_SIZE);
+}
+
+/* Take another reference to an allocated frame, such as for mapping it a second time */
+void pmm_page_get(Page* page) {
+    __atomic_add_fetch(&page->refcount, 1, __ATOMIC_RELAXED);
+}
+
+/* Drop a reference to a frame, freeing it if it was the last. Returns true if it was. */
+bool pmm_page_put(Page* page) {
+    return pmm_drop_page((uint64_t)(page - pmm_page_array));
+}
+
+/* Record who `length` frames from `addr` were handed out to */
+void pmm_set_owner(void* addr, size_t length, uint16_t owner) {
+    uint64_t page = (uintptr_t) addr / PAGE_SIZE;
+
+    for (uint64_t i = page; i < page + length && i < pmm_page_count; i++) {
+        pmm_page_array[i].owner = owner;
+    }
+}
+
+/* Node number for ACPI proximity domain `domain`, adding it if it is new, or PMM_NO_NODE if there are too many */
+static uint32_t pmm_numa_node(uint32_t domain) {
+    for (uint32_t node = 0; node < pmm_node_count; node++) {
+        if (pmm_node_domain[node] == domain) return node;
+    }
+
+    if (unlikely(pmm_node_count == PMM_MAX_NODES)) return PMM_NO_NODE;
+
+    pmm_node_domain[pmm_node_count] = domain;
+    return pmm_node_count++;
+}
+
+/*
+Number of pages from `start` to `end` that the PMM manages, i.e. that lie in
+usable RAM and were not reserved at boot, the same ones pmm_total_count counts.
+An SRAT range also spans holes, MMIO and memory the bitmap does not reach.
+*/
+static uint64_t pmm_managed_pages(uint64_t start, uint64_t end) {
+    uint64_t count = 0;
+
+    for (uint32_t i = 0; i < pmm_usable_count; i++) {
+        uint64_t lo = pmm_usable[i].start / PAGE_SIZE;
+        uint64_t hi = pmm_usable[i].end   / PAGE_SIZE;
+
+        if (lo < start) lo = start;
+        if (hi > end)   hi = end;
+
+        for (uint64_t page = lo; page < hi; page++) {
+            if (page >= pmm_page_count || !(pmm_page_array[page].flags & PAGE_FLAG_RESERVED)) count++;
+        }
+    }
+
+    return count;
+}
+
+/* Read the SRAT's CPU and memory affinity entries into the node tables */
+static void pmm_parse_srat(ACPI_TABLE_SRAT* srat) {
+    uint8_t* ptr = (uint8_t*)(srat + 1);
+    uint8_t* end = (uint8_t*) srat + srat->Header.Length;
+
+    while (ptr + sizeof(ACPI_SUBTABLE_HEADER) <= end) {
+        ACPI_SUBTABLE_HEADER* sub = (ACPI_SUBTABLE_HEADER*) ptr;
+        if (unlikely(sub->Length == 0)) break;
+
+        if (sub->Type == ACPI_SRAT_TYPE_CPU_AFFINITY) {
+            ACPI_SRAT_CPU_AFFINITY* cpu = (ACPI_SRAT_CPU_AFFINITY*) sub;
+
+            if (cpu->Flags & ACPI_SRAT_CPU_USE_AFFINITY) {
+                uint32_t domain = cpu->ProximityDomainLo
+                                | ((uint32_t) cpu->ProximityDomainHi[0] << 8)
+                                | ((uint32_t) cpu->ProximityDomainHi[1] << 16)
+                                | ((uint32_t) cpu->ProximityDomainHi[2] << 24);
+
+                uint32_t node = pmm_numa_node(domain);
+                if (node != PMM_NO_NODE) pmm_apic_node[cpu->ApicId] = node;
+            }
+        }
+
+        else if (sub->Type == ACPI_SRAT_TYPE_X2APIC_CPU_AFFINITY) {
+            ACPI_SRAT_X2APIC_CPU_AFFINITY* cpu = (ACPI_SRAT_X2APIC_CPU_AFFINITY*) sub;
+
+            // Cores past LAPIC ID 255 are not brought up anyway
+            if ((cpu->Flags & ACPI_SRAT_CPU_ENABLED) && cpu->ApicId < 256) {
+                uint32_t node = pmm_numa_node(cpu->ProximityDomain);
+                if (node != PMM_NO_NODE) pmm_apic_node[cpu->ApicId] = node;
+            }
+        }
+
+        else if (sub->Type == ACPI_SRAT_TYPE_MEMORY_AFFINITY) {
+            ACPI_SRAT_MEM_AFFINITY* mem = (ACPI_SRAT_MEM_AFFINITY*) sub;
+
+            uint64_t start = (mem->BaseAddress + PAGE_SIZE - 1) / PAGE_SIZE;
+            uint64_t stop  = (mem->BaseAddress + mem->Length) / PAGE_SIZE;
+            if (stop > pmm_pages) stop = pmm_pages;
+
+            if ((mem->Flags & ACPI_SRAT_MEM_ENABLED) && start < stop && pmm_numa_range_count < PMM_MAX_REGIONS) {
+                uint32_t node = pmm_numa_node(mem->ProximityDomain);
+
+                if (node != PMM_NO_NODE) {
+                    pmm_numa_ranges[pmm_numa_range_count++] = (PmmNumaRange) { start, stop, node };
+                    pmm_node_pages[node] += pmm_managed_pages(start, stop);
+                }
+            }
+        }
+
+        ptr += sub->Length;
+    }
+}
+
+/*
+Split the PMM into nodes by the ACPI SRAT, once ACPICA has its tables loaded.
+Every node gets a list of all nodes sorted by their SLIT distance from it,
+which is the order pages are looked for in when a core on it runs out of
+local memory. Without a SLIT, every other node is taken to be equally far.
+With no SRAT, or an SRAT that only describes one node, the PMM is left flat.
+*/
+void init_pmm_numa() {
+    ACPI_TABLE_HEADER* srat;
+    if (ACPI_FAILURE(AcpiGetTable(ACPI_SIG_SRAT, 1, &srat))) return;
+
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+
+    pmm_node_count = 0;
+    pmm_parse_srat((ACPI_TABLE_SRAT*) srat);
+
+    if (pmm_node_count <= 1) {
+        pmm_node_count       = 1;
+        pmm_numa_range_count = 0;
+        memset(pmm_apic_node, 0, sizeof(pmm_apic_node));
+
+        spin_unlock_irqrestore(&pmm_lock, flags);
+        return;
+    }
+
+    ACPI_TABLE_HEADER* header;
+    ACPI_TABLE_SLIT*   slit = NULL;
+    if (ACPI_SUCCESS(AcpiGetTable(ACPI_SIG_SLIT, 1, &header))) slit = (ACPI_TABLE_SLIT*) header;
+
+    uint8_t distance[PMM_MAX_NODES][PMM_MAX_NODES];
+
+    for (uint32_t a = 0; a < pmm_node_count; a++) {
+        for (uint32_t b = 0; b < pmm_node_count; b++) {
+            uint32_t da = pmm_node_domain[a];
+            uint32_t db = pmm_node_domain[b];
+
+            if (slit != NULL && da < slit->LocalityCount && db < slit->LocalityCount) {
+                distance[a][b] = slit->Entry[da * slit->LocalityCount + db];
+            } else {
+                distance[a][b] = (a == b) ? PMM_NUMA_LOCAL : PMM_NUMA_REMOTE;
+            }
+        }
+
+        // Insertion sort, nearest first, keeping the node itself at the front on ties
+        for (uint32_t i = 0; i < pmm_node_count; i++) {
+            uint32_t n = (i == 0) ? a : ((i <= a) ? i - 1 : i);
+            uint32_t j = i;
+
+            while (j > 0 && distance[a][pmm_node_order[a][j - 1]] > distance[a][n]) {
+                pmm_node_order[a][j] = pmm_node_order[a][j - 1];
+                j--;
+            }
+
+            pmm_node_order[a][j] = n;
+        }
+
+        pmm_node_hint[a] = pmm_words;
+    }
+
+    spin_unlock_irqrestore(&pmm_lock, flags);
+}
+
+/* Number of NUMA nodes, 1 if the PMM is flat */
+uint32_t pmm_get_node_count() {
+    return pmm_node_count;
+}
+
+/*
+Free and total pages of a node, counted from its ranges in the bitmap. The total
+only has the pages the PMM manages, so the nodes add up to pmm_get_total_pages.
+Returns false if there is no such node. On a flat PMM, node 0 is all of memory.
+*/
+bool pmm_get_node_stats(uint32_t node, PmmNodeStats* stats) {
+    if (unlikely(node >= pmm_node_count)) return false;
+
+    if (pmm_node_count == 1) {
+        stats->domain      = 0;
+        stats->free_pages  = pmm_free_count;
+        stats->total_pages = pmm_total_count;
+        return true;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&pmm_lock);
+
+    stats->domain      = pmm_node_domain[node];
+    stats->total_pages = pmm_node_pages[node];
+    stats->free_pages  = 0;
+
+    for (uint32_t i = 0; i < pmm_numa_range_count; i++) {
+        if (pmm_numa_ranges[i].node != node) continue;
+        stats->free_pages += pmm_count_free(pmm_numa_ranges[i].start, pmm_numa_ranges[i].end);
+    }
 
-    spin_lock(&pmm_lock);
-    pmm_clear_bit(page_number);
-    spin_unlock(&pmm_lock);
+    spin_unlock_irqrestore(&pmm_lock, flags);
+    return true;
 }
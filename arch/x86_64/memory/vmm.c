@@ -23,8 +23,13 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "klib/string.h"
 
+#include "hal.h"
+#include "multiboot.h"
+
 #include "cpu/multicore.h"
+#include "drivers/terminal.h"
 #include "memory/pmm.h"
+#include "memory/zeropool.h"
 
 #include "memory/vmm.h"
 
@@ -34,18 +39,86 @@ const uint64_t PAGE_USER    = 0x4;  // 10e2 in binary - 0 = Kernel only, 1 = Eve
 const uint64_t PAGE_PWT     = 0x8;  // 10e3 in binary - Writes go to cache and memory immediately
 const uint64_t PAGE_PCD     = 0x10; // 10e4 in binary - Completely disables CPU caching for that page
 const uint64_t PAGE_CACHE   = 0x0;  // Not present in x86, does nothing, but required stub
+const uint64_t PAGE_HUGE    = 0x80; // 10e7 in binary - Leaf of 2 MB in a PD, or of 1 GB in a PDPT
+const uint64_t PAGE_GLOBAL  = 0x100; // 10e8 in binary - Kept in the TLB across CR3 loads
+const uint64_t PAGE_COW     = 0x200; // 10e9 in binary - Free for the OS: read-only share of a writable page
 
 #define PAGING_BIT  0x80000000
 #define PAGE_WP_BIT 0x00010000
 
 #define PAGE_MASK 0x000FFFFFFFFFF000ULL
 
+#define VMM_FLUSH_THRESHOLD 32 // Pages past which reloading CR3 beats an invlpg for each
+
+#define USER_SPACE_PAGES (0x0000800000000000ULL / PAGE_SIZE) // The whole lower half
+
+#define VMM_ASID_COUNT 32 // Address spaces each core keeps tagged in its TLB at once
+
+#define CR3_NOFLUSH (1ULL << 63) // Keep the TLB entries tagged with the PCID being loaded
+#define CR4_PGE     (1 << 7)
+#define CR4_PCIDE   (1 << 17)
+
+#define CPUID_FEATURES     0x1
+#define CPUID_PGE          (1 << 13) // EDX: global pages
+#define CPUID_PCID         (1 << 17) // ECX: process-context identifiers
+#define CPUID_EXT_FEATURES 0x80000001
+#define CPUID_PDPE1GB      (1 << 26) // EDX: 1 GB pages
+
 uint64_t* kernel_directory = NULL;
 
-static spinlock vmm_lock = 0;
+static spinlock vmm_lock = 0; // Always taken with interrupts off, since page faults map pages
+
+static bool vmm_has_1g_pages = false;
+static bool vmm_has_pge      = false;
+static bool vmm_has_pcid     = false;
+
+// The PML4 each of a core's ASIDs (PCIDs) currently tags, ASID 0 being the kernel's
+static uint64_t vmm_asid_owner[MAX_CORES][VMM_ASID_COUNT];
+static uint32_t vmm_asid_next[MAX_CORES];
 
 // TODO: bit shifting 39, 30, etc. and & 0x1FF is common enough to have its own macro.
 
+/* The higher half is the same in every address space, so its pages are global */
+static inline uint64_t vmm_leaf_flags(uint64_t virt_addr, uint64_t flags) {
+    return (virt_addr >= DIRECT_MAP_BASE) ? (flags | PAGE_GLOBAL) : flags;
+}
+
+/*
+Map every RAM region in the multiboot memory map into the direct map of `pd_phys`,
+along with the first VMM_INIT_MAP_SIZE_MB, which holds the BIOS areas, VGA memory,
+and the boot structures. ACPI regions (type 3 and 4) are included as well, so that
+ACPICA can read its tables without mapping them. Regions are rounded out to whole
+pages, and vmm_map_range uses the largest pages it can for each. Whatever of a
+region lies in that first VMM_INIT_MAP_SIZE_MB is skipped, since it is already
+mapped with 2 MB pages that would only be split up again.
+*/
+static void vmm_map_direct(uint64_t* pd_phys) {
+    uint64_t flags    = PAGE_PRESENT | PAGE_RW;
+    uint64_t low_size = (uint64_t) VMM_INIT_MAP_SIZE_MB << 20;
+
+    vmm_map_range(pd_phys, NULL, PHYSICAL_TO_VIRTUAL(0), low_size / PAGE_SIZE, flags);
+
+    multiboot_mmap_entry* mmap = (multiboot_mmap_entry*)((uintptr_t) PHYSICAL_TO_VIRTUAL(mbi->mmap_addr));
+    uintptr_t mmap_end = (uintptr_t) mmap + mbi->mmap_length;
+
+    while ((uintptr_t) mmap < mmap_end) {
+        uint32_t entry_size = *(uint32_t*)((uintptr_t) mmap - 4);
+
+        if (mmap->type == 1 || mmap->type == 3 || mmap->type == 4) {
+            uint64_t start = mmap->addr & ~(uint64_t)(PAGE_SIZE - 1);
+            uint64_t end   = (mmap->addr + mmap->len + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+
+            if (start < low_size) start = low_size;
+
+            if (end > start) {
+                vmm_map_range(pd_phys, (void*) start, PHYSICAL_TO_VIRTUAL(start), (end - start) / PAGE_SIZE, flags);
+            }
+        }
+
+        mmap = (multiboot_mmap_entry*)((uintptr_t) mmap + entry_size + 4);
+    }
+}
+
 /*
 We need both Identity Mapping (where Virtual Address 0x1000 equals Physical Address 0x1000)
 as well as Higher Half Mapping (where the kernel lives up at PAGE_OFFSET), hence why we need
@@ -59,9 +132,10 @@ stuck with just 1 GB of RAM that was mapped back at boot.s. Once this function i
 we clean up identity PDPT to give us that precious RAM back.
 
 The PML4 is the kernel_directory, which holds exactly 512 slots, starting from index 0. Each
-slot holds a pointer to a PDPT. Currently, there are only two PDPTs, the two we just created.
-The first slot (index 0) is set to the identity PDPT (flagged to exist and be read/write).
-The kernel PDPT is set to the 510th slot ((PAGE_OFFSET >> 39) & 0x1FF), under the same flags.
+slot holds a pointer to a PDPT. Currently, there are three PDPTs, the two above and the direct
+map's. The first slot (index 0) is set to the identity PDPT (flagged to exist and be read/write).
+The kernel PDPT is set to the 511th slot ((PAGE_OFFSET >> 39) & 0x1FF), under the same flags,
+and the direct map PDPT to the 256th ((DIRECT_MAP_BASE >> 39) & 0x1FF).
 
 In x86_64, memory is split off into four layers, each of which are sort of dictionaries that
 point to a set of the next layer.
@@ -72,18 +146,36 @@ point to a set of the next layer.
 This gives us a total of 512 * 512 * 512 * 512 = 16TB of addressable memory. The next for loop is to do just
 that loop through the PD and PT to fill them out ito the kernel PDPT.
 
-Currently, we only map out 8 MB at boot. This 8 MB of RAM is simply available to the kernel, but can be
-used by another application if required. In terms of physical RAM used here, each dictionary calls for
-another page in the PMM, each of which is 4 KB in size. We use exactly:-
+The kernel image window only spans VMM_INIT_MAP_SIZE_MB (16 MB), which is where the heap takes over
+at HEAP_START. It is mapped with 2 MB pages, set straight in the PDs, so no PTs are needed at all, and
+the kernel image takes a handful of TLB entries instead of one per 4 KB. In terms of physical RAM used
+here, each dictionary calls for another page in the PMM, each of which is 4 KB in size. We use:-
+
+1 PML4 + 3 PDPT + 2 PD
+= (1 + 3 + 2) * 4 KB = 24 KB (physical RAM)
 
-1 PML4 + 2 PDPT + 1 PD + 4 PT
-= (1 + 2 + 1 + 4) * 4 KB = 32 KB (physical RAM)
+plus the direct map's own tables: a PD for each GB of RAM without 1 GB pages, and a PT wherever
+a region does not start or end on a 2 MB boundary.
+
+Then, all of RAM is mapped a second time into the direct map at DIRECT_MAP_BASE (PML4 slot 256), which
+is what PHYSICAL_TO_VIRTUAL points into. This is done once, with 1 GB pages where the CPU has them and
+2 MB pages otherwise, so page tables, slabs, and any other frame from the PMM can be written to straight
+away, without having to be mapped first. Its PDPT is made here, before any address space copies the
+kernel's upper half, so every address space shares the same direct map. See vmm_map_direct.
+
+Once the new directory is loaded, global pages and PCIDs are switched on where CPUID reports them. Every
+higher half mapping is global, so it stays in the TLB when CR3 changes, and each address space is given
+an ASID by vmm_switch_directory, so that switching between them does not throw away their TLB entries.
 
 Note that the actual directories are set to the virtual addresses, because boot.s already enabled paging.
 
 TODO: Consider what resursive mapping is, left out kernel PDPT slot 511 in case we'd need it.
 */
 void init_vmm() {
+    uint32_t eax, ebx, ecx, edx;
+    cpu_cpuid(CPUID_EXT_FEATURES, 0, &eax, &ebx, &ecx, &edx);
+    vmm_has_1g_pages = (edx & CPUID_PDPE1GB) != 0;
+
     // Allocate PML4 Root
     uint64_t phys_kernel_directory = (uint64_t) pmm_alloc_page();
     kernel_directory = (uint64_t*) PHYSICAL_TO_VIRTUAL(phys_kernel_directory);
@@ -98,7 +190,11 @@ void init_vmm() {
     uint64_t* kernel_pdpt = (uint64_t*) PHYSICAL_TO_VIRTUAL(phys_kernel_pdpt);
     memset(kernel_pdpt, 0, PAGE_SIZE);
 
+    uint64_t phys_direct_pdpt = (uint64_t) pmm_alloc_page();
+    memset(PHYSICAL_TO_VIRTUAL(phys_direct_pdpt), 0, PAGE_SIZE);
+
     kernel_directory[0] = phys_identity_pdpt | PAGE_PRESENT | PAGE_RW;
+    kernel_directory[(DIRECT_MAP_BASE >> 39) & 0x1FF] = phys_direct_pdpt | PAGE_PRESENT | PAGE_RW;
     kernel_directory[(PAGE_OFFSET >> 39) & 0x1FF] = phys_kernel_pdpt | PAGE_PRESENT | PAGE_RW;
 
     // Allocate separate Page Directories for Identity and Higher Half
@@ -114,79 +210,418 @@ void init_vmm() {
     uint64_t kernel_pdpt_idx = (PAGE_OFFSET >> 30) & 0x1FF;
     kernel_pdpt[kernel_pdpt_idx] = phys_k_pd | PAGE_PRESENT | PAGE_RW;
 
-    // Map the physical memory to both regions
+    // Map the physical memory to both regions, 2 MB at a time
     for (uint64_t j = 0; j < VMM_INIT_MAP_SIZE_MB / 2; j++) {
-        uint64_t phys_pt = (uint64_t) pmm_alloc_page();
-        uint64_t* pt_ptr = (uint64_t*) PHYSICAL_TO_VIRTUAL(phys_pt);
-        memset(pt_ptr, 0, PAGE_SIZE);
+        uint64_t physical_addr = j * PAGE_SIZE_2M;
+
+        id_pd_ptr[j] = physical_addr | PAGE_PRESENT | PAGE_RW | PAGE_HUGE;
+        k_pd_ptr[j]  = physical_addr | PAGE_PRESENT | PAGE_RW | PAGE_HUGE | PAGE_GLOBAL;
+    }
+
+    vmm_map_direct((uint64_t*) phys_kernel_directory);
+    vmm_switch_directory((uint64_t*) phys_kernel_directory);
+
+    cpu_cpuid(CPUID_FEATURES, 0, &eax, &ebx, &ecx, &edx);
+    vmm_has_pge  = (edx & CPUID_PGE) != 0;
+    vmm_has_pcid = (ecx & CPUID_PCID) != 0;
+
+    for (uint32_t core = 0; core < MAX_CORES; core++) {
+        vmm_asid_owner[core][0] = phys_kernel_directory;
+    }
+
+    // CR3 holds PCID 0 right now, which PCIDE requires when it is switched on
+    uint64_t cr4;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+
+    if (vmm_has_pge)  cr4 |= CR4_PGE;
+    if (vmm_has_pcid) cr4 |= CR4_PCIDE;
 
-        // Link the page table into both directories
-        id_pd_ptr[j] = phys_pt | PAGE_PRESENT | PAGE_RW;
-        k_pd_ptr[j]  = phys_pt | PAGE_PRESENT | PAGE_RW;
+    asm volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
 
-        for (uint64_t k = 0; k < 512; k++) {
-            uint64_t physical_addr = (j * 512 * PAGE_SIZE) + (k * PAGE_SIZE);
-            pt_ptr[k] = physical_addr | PAGE_PRESENT | PAGE_RW;
+    // Make the kernel respect read-only user pages too, so it cannot write through a copy-on-write share
+    uint64_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    asm volatile("mov %0, %%cr0" : : "r"(cr0 | PAGE_WP_BIT) : "memory");
+}
+
+/*
+Drop the TLB entries for `count` pages at `virt_addr` after their mappings changed.
+A short range gets an invlpg per page, while a long one flushes the whole TLB at
+once, which is cheaper than hundreds of invlpgs. Reloading CR3 only drops the
+current ASID's entries and keeps global ones, so a long range in the higher half
+toggles CR4.PGE instead, which drops everything.
+*/
+static void vmm_flush_range(uint64_t virt_addr, uint64_t count) {
+    if (count > VMM_FLUSH_THRESHOLD) {
+        if (virt_addr >= DIRECT_MAP_BASE && vmm_has_pge) {
+            uint64_t cr4;
+            asm volatile("mov %%cr4, %0" : "=r"(cr4));
+            asm volatile("mov %0, %%cr4" : : "r"(cr4 & ~(uint64_t) CR4_PGE) : "memory");
+            asm volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+        } else {
+            uint64_t cr3;
+            asm volatile("mov %%cr3, %0\n\tmov %0, %%cr3" : "=r"(cr3) : : "memory");
         }
+
+        return;
     }
 
-    vmm_switch_directory((uint64_t*) phys_kernel_directory);
+    for (uint64_t i = 0; i < count; i++) {
+        asm volatile("invlpg (%0)" : : "r"(virt_addr + i * PAGE_SIZE) : "memory");
+    }
 }
 
-/* Map physical page to virtual */
-void vmm_map_page(uint64_t* pd_phys, void* phys, void* virt, uint64_t flags) {
-    uint64_t virt_addr = (uint64_t) virt;
+/*
+Break the large page of `size` bytes at `*entry`, which maps `virt_addr`, into
+a table of the next size down mapping exactly the same memory, so that part of
+it can be remapped or unmapped. A 1 GB page becomes 512 pages of 2 MB. Returns
+false, leaving the large page as it was, if no frame was left for the table.
+The VMM lock must be held.
+*/
+static bool vmm_split_large(uint64_t* entry, uint64_t virt_addr, uint64_t size) {
+    uint64_t table_phys = (uint64_t) pmm_alloc_page();
+    if (unlikely(table_phys == 0)) return false;
+
+    uint64_t* table = (uint64_t*) PHYSICAL_TO_VIRTUAL(table_phys);
+    pmm_set_owner((void*) table_phys, 1, PAGE_OWNER_PAGE_TABLE);
+
+    uint64_t base  = *entry & PAGE_MASK & ~(size - 1);
+    uint64_t flags = *entry & ~PAGE_MASK & ~PAGE_HUGE;
+    uint64_t step  = size / 512;
+
+    if (size == PAGE_SIZE_1G) flags |= PAGE_HUGE;
+
+    for (uint64_t i = 0; i < 512; i++) {
+        table[i] = (base + i * step) | flags;
+    }
+
+    *entry = table_phys | (flags & (PAGE_PRESENT | PAGE_RW | PAGE_USER));
+    asm volatile("invlpg (%0)" : : "r"(virt_addr) : "memory");
+
+    return true;
+}
 
+/*
+Step from entry `index` of `table` down to the table it points to, creating it
+if it is missing, or splitting the large page of `size` bytes there. Returns
+NULL if memory for that ran out. The VMM lock must be held.
+*/
+static uint64_t* vmm_next_table(uint64_t* table, uint64_t index, uint64_t table_flags,
+                                uint64_t virt_addr, uint64_t size) {
+    if (unlikely(!(table[index] & PAGE_PRESENT))) {
+        uint64_t phys = (uint64_t) pmm_alloc_zeroed_page();
+        if (unlikely(phys == 0)) return NULL;
+
+        pmm_set_owner((void*) phys, 1, PAGE_OWNER_PAGE_TABLE);
+        table[index] = phys | table_flags;
+    } else {
+        if (unlikely(table[index] & PAGE_HUGE) && !vmm_split_large(&table[index], virt_addr, size)) return NULL;
+
+        // Inherit flags upward if a subsequent mapping requires broader permissions (e.g., User access)
+        table[index] |= table_flags;
+    }
+
+    return (uint64_t*) PHYSICAL_TO_VIRTUAL(table[index] & PAGE_MASK);
+}
+
+/*
+Walk down to the page table covering `virt`, creating any missing level on the
+way. Returns the page table's virtual address, or NULL if memory for a level ran
+out. The VMM lock must be held.
+*/
+static uint64_t* vmm_get_page_table(uint64_t* pml4_virt, uint64_t virt_addr, uint64_t table_flags) {
     uint64_t pml4_idx  = (virt_addr >> 39) & 0x1FF;
     uint64_t pdpt_idx  = (virt_addr >> 30) & 0x1FF;
     uint64_t pd_idx    = (virt_addr >> 21) & 0x1FF;
-    uint64_t pt_idx    = (virt_addr >> 12) & 0x1FF;
 
-    // Extract table-level permission flags (Present, R/W, User) from the target flags
+    // PML4 -> PDPT -> PD -> PT
+    uint64_t* pdpt_virt = vmm_next_table(pml4_virt, pml4_idx, table_flags, virt_addr, 0);
+    if (unlikely(pdpt_virt == NULL)) return NULL;
+
+    uint64_t* pd_virt = vmm_next_table(pdpt_virt, pdpt_idx, table_flags, virt_addr, PAGE_SIZE_1G);
+    if (unlikely(pd_virt == NULL)) return NULL;
+
+    return vmm_next_table(pd_virt, pd_idx, table_flags, virt_addr, PAGE_SIZE_2M);
+}
+
+/*
+Map one large page of `size` (PAGE_SIZE_2M or PAGE_SIZE_1G) at `virt_addr`.
+A PT already in the way of a 2 MB page is freed, since all of its range is
+being remapped. A 1 GB page is only set over an empty or large PDPT entry.
+Returns false if it could not be set, or a table above it could not be
+allocated. The VMM lock must be held.
+*/
+static bool vmm_set_large(uint64_t* pml4_virt, uint64_t phys_addr, uint64_t virt_addr, uint64_t size, uint64_t flags) {
+    uint64_t pml4_idx = (virt_addr >> 39) & 0x1FF;
+    uint64_t pdpt_idx = (virt_addr >> 30) & 0x1FF;
+    uint64_t pd_idx   = (virt_addr >> 21) & 0x1FF;
+
     uint64_t table_flags = flags & (PAGE_PRESENT | PAGE_RW | PAGE_USER);
+    uint64_t* pdpt_virt  = vmm_next_table(pml4_virt, pml4_idx, table_flags, virt_addr, 0);
+    if (unlikely(pdpt_virt == NULL)) return false;
 
-    spin_lock(&vmm_lock);
+    if (size == PAGE_SIZE_1G) {
+        uint64_t old = pdpt_virt[pdpt_idx];
+        if ((old & PAGE_PRESENT) && !(old & PAGE_HUGE)) return false;
 
-    uint64_t* pml4_virt = (uint64_t*) PHYSICAL_TO_VIRTUAL(pd_phys);
+        pdpt_virt[pdpt_idx] = phys_addr | vmm_leaf_flags(virt_addr, flags) | PAGE_HUGE;
+        asm volatile("invlpg (%0)" : : "r"(virt_addr) : "memory");
 
-    // PML4 -> PDPT
-    if (unlikely(!(pml4_virt[pml4_idx] & PAGE_PRESENT))) {
-        uint64_t phys_pdpt = (uint64_t) pmm_alloc_page();
-        pml4_virt[pml4_idx] = phys_pdpt | table_flags;
-        memset((uint64_t*) PHYSICAL_TO_VIRTUAL(phys_pdpt), 0, PAGE_SIZE);
-    } else {
-        // Inherit flags upward if a subsequent mapping requires broader permissions (e.g., User access)
-        pml4_virt[pml4_idx] |= table_flags;
+        return true;
     }
-    uint64_t* pdpt_virt = (uint64_t*) PHYSICAL_TO_VIRTUAL(pml4_virt[pml4_idx] & PAGE_MASK);
 
-    // PDPT -> PD
-    if (unlikely(!(pdpt_virt[pdpt_idx] & PAGE_PRESENT))) {
-        uint64_t phys_pd = (uint64_t) pmm_alloc_page();
-        pdpt_virt[pdpt_idx] = phys_pd | table_flags;
-        memset((uint64_t*) PHYSICAL_TO_VIRTUAL(phys_pd), 0, PAGE_SIZE);
+    uint64_t* pd_virt = vmm_next_table(pdpt_virt, pdpt_idx, table_flags, virt_addr, PAGE_SIZE_1G);
+    if (unlikely(pd_virt == NULL)) return false;
+
+    uint64_t old = pd_virt[pd_idx];
+
+    pd_virt[pd_idx] = phys_addr | vmm_leaf_flags(virt_addr, flags) | PAGE_HUGE;
+
+    if ((old & PAGE_PRESENT) && !(old & PAGE_HUGE)) {
+        // The old PT's pages may each still be cached, so each one is flushed
+        for (uint64_t v = virt_addr; v < virt_addr + PAGE_SIZE_2M; v += PAGE_SIZE) {
+            asm volatile("invlpg (%0)" : : "r"(v) : "memory");
+        }
+
+        pmm_free_page((void*)(old & PAGE_MASK));
     } else {
-        pdpt_virt[pdpt_idx] |= table_flags;
+        asm volatile("invlpg (%0)" : : "r"(virt_addr) : "memory");
     }
-    uint64_t* pd_virt = (uint64_t*) PHYSICAL_TO_VIRTUAL(pdpt_virt[pdpt_idx] & PAGE_MASK);
 
-    // PD -> PT
-    if (unlikely(!(pd_virt[pd_idx] & PAGE_PRESENT))) {
-        uint64_t phys_pt = (uint64_t) pmm_alloc_page();
-        pd_virt[pd_idx] = phys_pt | table_flags;
-        memset((uint64_t*) PHYSICAL_TO_VIRTUAL(phys_pt), 0, PAGE_SIZE);
-    } else {
-        pd_virt[pd_idx] |= table_flags;
+    return true;
+}
+
+/*
+Map a single large page of `size` bytes, PAGE_SIZE_2M or PAGE_SIZE_1G, with
+`phys` and `virt` both aligned to it. Returns false if they are not, if the
+CPU has no 1 GB pages, or if a 1 GB page would replace a page directory.
+*/
+bool vmm_map_large(uint64_t* pd_phys, void* phys, void* virt, uint64_t size, uint64_t flags) {
+    uint64_t phys_addr = (uint64_t) phys;
+    uint64_t virt_addr = (uint64_t) virt;
+
+    if (unlikely(size != PAGE_SIZE_2M && size != PAGE_SIZE_1G)) return false;
+    if (unlikely(size == PAGE_SIZE_1G && !vmm_has_1g_pages)) return false;
+    if (unlikely(((phys_addr | virt_addr) & (size - 1)) != 0)) return false;
+
+    uint64_t irq_flags = spin_lock_irqsave(&vmm_lock);
+
+    uint64_t* pml4_virt = (uint64_t*) PHYSICAL_TO_VIRTUAL(pd_phys);
+    bool mapped = vmm_set_large(pml4_virt, phys_addr, virt_addr, size, flags);
+
+    spin_unlock_irqrestore(&vmm_lock, irq_flags);
+    return mapped;
+}
+
+/* Map physical page to virtual. Returns false if a page table could not be allocated. */
+bool vmm_map_page(uint64_t* pd_phys, void* phys, void* virt, uint64_t flags) {
+    uint64_t virt_addr = (uint64_t) virt;
+    uint64_t pt_idx    = (virt_addr >> 12) & 0x1FF;
+
+    // Extract table-level permission flags (Present, R/W, User) from the target flags
+    uint64_t table_flags = flags & (PAGE_PRESENT | PAGE_RW | PAGE_USER);
+
+    uint64_t irq_flags = spin_lock_irqsave(&vmm_lock);
+
+    uint64_t* pml4_virt = (uint64_t*) PHYSICAL_TO_VIRTUAL(pd_phys);
+    uint64_t* pt_virt   = vmm_get_page_table(pml4_virt, virt_addr, table_flags);
+
+    if (unlikely(pt_virt == NULL)) {
+        spin_unlock_irqrestore(&vmm_lock, irq_flags);
+        return false;
     }
-    uint64_t* pt_virt = (uint64_t*) PHYSICAL_TO_VIRTUAL(pd_virt[pd_idx] & PAGE_MASK);
 
     // Map the leaf physical page layout inside the Page Table
-    pt_virt[pt_idx] = (uint64_t) phys | flags;
+    pt_virt[pt_idx] = (uint64_t) phys | vmm_leaf_flags(virt_addr, flags);
 
     // Flush the TLB for this specific virtual address modification
     asm volatile("invlpg (%0)" : : "r"(virt) : "memory");
 
-    spin_unlock(&vmm_lock);
+    spin_unlock_irqrestore(&vmm_lock, irq_flags);
+    return true;
+}
+
+/*
+Map `count` physically contiguous pages starting at `phys` to `virt`. The lock
+is taken once and the tables are only walked again when the run crosses into
+the next page table, instead of once per page. Wherever both addresses line up
+on a 1 GB or 2 MB boundary with that much of the run left, a large page is
+used instead. The TLB is only flushed once at the end, and only if an entry
+that was already present got replaced. Returns false if a page table could not
+be allocated, in which case only the part of the range before it is mapped.
+*/
+bool vmm_map_range(uint64_t* pd_phys, void* phys, void* virt, uint64_t count, uint64_t flags) {
+    uint64_t virt_addr = (uint64_t) virt;
+    uint64_t phys_addr = (uint64_t) phys;
+
+    uint64_t table_flags = flags & (PAGE_PRESENT | PAGE_RW | PAGE_USER);
+
+    uint64_t irq_flags = spin_lock_irqsave(&vmm_lock);
+
+    uint64_t* pml4_virt = (uint64_t*) PHYSICAL_TO_VIRTUAL(pd_phys);
+    uint64_t* pt_virt   = NULL;
+
+    uint64_t start  = virt_addr;
+    bool     stale  = false;
+    bool     mapped = true;
+
+    for (uint64_t i = 0; i < count;) {
+        uint64_t left    = count - i;
+        uint64_t aligned = phys_addr | virt_addr;
+
+        if (unlikely(vmm_has_1g_pages && (aligned & (PAGE_SIZE_1G - 1)) == 0 && left >= PAGE_SIZE_1G / PAGE_SIZE)
+            && vmm_set_large(pml4_virt, phys_addr, virt_addr, PAGE_SIZE_1G, flags)) {
+            i         += PAGE_SIZE_1G / PAGE_SIZE;
+            virt_addr += PAGE_SIZE_1G;
+            phys_addr += PAGE_SIZE_1G;
+            pt_virt    = NULL;
+            continue;
+        }
+
+        if ((aligned & (PAGE_SIZE_2M - 1)) == 0 && left >= PAGE_SIZE_2M / PAGE_SIZE) {
+            if (unlikely(!vmm_set_large(pml4_virt, phys_addr, virt_addr, PAGE_SIZE_2M, flags))) {
+                mapped = false;
+                break;
+            }
+
+            i         += PAGE_SIZE_2M / PAGE_SIZE;
+            virt_addr += PAGE_SIZE_2M;
+            phys_addr += PAGE_SIZE_2M;
+            pt_virt    = NULL;
+            continue;
+        }
+
+        uint64_t pt_idx = (virt_addr >> 12) & 0x1FF;
+
+        if (unlikely(pt_virt == NULL || pt_idx == 0)) {
+            pt_virt = vmm_get_page_table(pml4_virt, virt_addr, table_flags);
+
+            if (unlikely(pt_virt == NULL)) {
+                mapped = false;
+                break;
+            }
+        }
+
+        if (unlikely(pt_virt[pt_idx] & PAGE_PRESENT)) stale = true;
+        pt_virt[pt_idx] = phys_addr | vmm_leaf_flags(virt_addr, flags);
+
+        i++;
+        virt_addr += PAGE_SIZE;
+        phys_addr += PAGE_SIZE;
+    }
+
+    if (unlikely(stale)) vmm_flush_range(start, count);
+
+    spin_unlock_irqrestore(&vmm_lock, irq_flags);
+    return mapped;
+}
+
+/* Give the `pages` frames from `phys` back to the PMM, one reference each */
+static void vmm_free_frames(uint64_t phys, uint64_t pages) {
+    for (uint64_t i = 0; i < pages; i++) {
+        pmm_free_page((void*)(phys + i * PAGE_SIZE));
+    }
+}
+
+/*
+Unmap `count` pages starting at `virt` in `pd_phys`, handing their frames back to
+the PMM as well if `free_frames` is set. Like vmm_map_range, the tables are walked
+once per page table rather than once per page, whole large pages inside the range
+are cleared with a single store, and levels that are not there are skipped over
+entirely. A large page the range only partly covers is split first. The TLB is
+flushed once at the end. Returns false if a split ran out of memory, in which
+case the range is only unmapped up to that large page.
+*/
+bool vmm_unmap_range(uint64_t* pd_phys, void* virt, uint64_t count, bool free_frames) {
+    uint64_t virt_addr = (uint64_t) virt;
+    uint64_t end       = virt_addr + count * PAGE_SIZE;
+
+    uint64_t irq_flags = spin_lock_irqsave(&vmm_lock);
+
+    uint64_t* pml4_virt = (uint64_t*) PHYSICAL_TO_VIRTUAL(pd_phys);
+    bool      cleared   = false;
+    bool      unmapped  = true;
+
+    while (virt_addr < end) {
+        uint64_t pml4_idx = (virt_addr >> 39) & 0x1FF;
+        uint64_t pdpt_idx = (virt_addr >> 30) & 0x1FF;
+        uint64_t pd_idx   = (virt_addr >> 21) & 0x1FF;
+
+        if (unlikely(!(pml4_virt[pml4_idx] & PAGE_PRESENT))) {
+            virt_addr = (virt_addr | ((1ULL << 39) - 1)) + 1;
+            continue;
+        }
+
+        uint64_t* pdpt_virt = (uint64_t*) PHYSICAL_TO_VIRTUAL(pml4_virt[pml4_idx] & PAGE_MASK);
+        uint64_t  pdpte     = pdpt_virt[pdpt_idx];
+
+        if (unlikely(!(pdpte & PAGE_PRESENT))) {
+            virt_addr = (virt_addr | (PAGE_SIZE_1G - 1)) + 1;
+            continue;
+        }
+
+        if (unlikely(pdpte & PAGE_HUGE)) {
+            if ((virt_addr & (PAGE_SIZE_1G - 1)) == 0 && end - virt_addr >= PAGE_SIZE_1G) {
+                pdpt_virt[pdpt_idx] = 0;
+                if (free_frames) vmm_free_frames(pdpte & PAGE_MASK, PAGE_SIZE_1G / PAGE_SIZE);
+
+                cleared    = true;
+                virt_addr += PAGE_SIZE_1G;
+                continue;
+            }
+
+            if (unlikely(!vmm_split_large(&pdpt_virt[pdpt_idx], virt_addr, PAGE_SIZE_1G))) {
+                unmapped = false;
+                break;
+            }
+        }
+
+        uint64_t* pd_virt = (uint64_t*) PHYSICAL_TO_VIRTUAL(pdpt_virt[pdpt_idx] & PAGE_MASK);
+        uint64_t  pde     = pd_virt[pd_idx];
+
+        if (unlikely(!(pde & PAGE_PRESENT))) {
+            virt_addr = (virt_addr | (PAGE_SIZE_2M - 1)) + 1;
+            continue;
+        }
+
+        if (pde & PAGE_HUGE) {
+            if ((virt_addr & (PAGE_SIZE_2M - 1)) == 0 && end - virt_addr >= PAGE_SIZE_2M) {
+                pd_virt[pd_idx] = 0;
+                if (free_frames) vmm_free_frames(pde & PAGE_MASK, PAGE_SIZE_2M / PAGE_SIZE);
+
+                cleared    = true;
+                virt_addr += PAGE_SIZE_2M;
+                continue;
+            }
+
+            if (unlikely(!vmm_split_large(&pd_virt[pd_idx], virt_addr, PAGE_SIZE_2M))) {
+                unmapped = false;
+                break;
+            }
+        }
+
+        // Clear the rest of this page table's share of the range in one go
+        uint64_t* pt_virt = (uint64_t*) PHYSICAL_TO_VIRTUAL(pd_virt[pd_idx] & PAGE_MASK);
+        uint64_t  pt_end  = (virt_addr | (PAGE_SIZE_2M - 1)) + 1;
+        if (pt_end > end) pt_end = end;
+
+        for (; virt_addr < pt_end; virt_addr += PAGE_SIZE) {
+            uint64_t pt_idx = (virt_addr >> 12) & 0x1FF;
+            uint64_t pte    = pt_virt[pt_idx];
+
+            if (!(pte & PAGE_PRESENT)) continue;
+
+            pt_virt[pt_idx] = 0;
+            if (free_frames) pmm_free_page((void*)(pte & PAGE_MASK));
+
+            cleared = true;
+        }
+    }
+
+    if (likely(cleared)) vmm_flush_range((uint64_t) virt, count);
+
+    spin_unlock_irqrestore(&vmm_lock, irq_flags);
+    return unmapped;
 }
 
 /* Unmap virtual address from physical */
@@ -198,31 +633,44 @@ uint64_t vmm_unmap_page(void* virt) {
     uint64_t pd_idx    = (virt_addr >> 21) & 0x1FF;
     uint64_t pt_idx    = (virt_addr >> 12) & 0x1FF;
 
-    spin_lock(&vmm_lock);
+    uint64_t irq_flags = spin_lock_irqsave(&vmm_lock);
 
     uint64_t* pml4_virt = (uint64_t*) PHYSICAL_TO_VIRTUAL(vmm_get_current_directory());
 
     if (unlikely(!(pml4_virt[pml4_idx] & PAGE_PRESENT))) {
-        spin_unlock(&vmm_lock);
+        spin_unlock_irqrestore(&vmm_lock, irq_flags);
         return 0;
     }
     uint64_t* pdpt_virt = (uint64_t*) PHYSICAL_TO_VIRTUAL(pml4_virt[pml4_idx] & PAGE_MASK);
 
     if (unlikely(!(pdpt_virt[pdpt_idx] & PAGE_PRESENT))) {
-        spin_unlock(&vmm_lock);
+        spin_unlock_irqrestore(&vmm_lock, irq_flags);
         return 0;
     }
+
+    // Only this 4 KB page goes, so a large page around it is split first
+    if (unlikely(pdpt_virt[pdpt_idx] & PAGE_HUGE) && !vmm_split_large(&pdpt_virt[pdpt_idx], virt_addr, PAGE_SIZE_1G)) {
+        spin_unlock_irqrestore(&vmm_lock, irq_flags);
+        return 0;
+    }
+
     uint64_t* pd_virt = (uint64_t*) PHYSICAL_TO_VIRTUAL(pdpt_virt[pdpt_idx] & PAGE_MASK);
 
     if (unlikely(!(pd_virt[pd_idx] & PAGE_PRESENT))) {
-        spin_unlock(&vmm_lock);
+        spin_unlock_irqrestore(&vmm_lock, irq_flags);
         return 0;
     }
+
+    if (unlikely(pd_virt[pd_idx] & PAGE_HUGE) && !vmm_split_large(&pd_virt[pd_idx], virt_addr, PAGE_SIZE_2M)) {
+        spin_unlock_irqrestore(&vmm_lock, irq_flags);
+        return 0;
+    }
+
     uint64_t* pt_virt = (uint64_t*) PHYSICAL_TO_VIRTUAL(pd_virt[pd_idx] & PAGE_MASK);
 
     // Hardening check: Ensure the leaf page table entry itself is actually present
     if (unlikely(!(pt_virt[pt_idx] & PAGE_PRESENT))) {
-        spin_unlock(&vmm_lock);
+        spin_unlock_irqrestore(&vmm_lock, irq_flags);
         return 0;
     }
 
@@ -235,18 +683,268 @@ uint64_t vmm_unmap_page(void* virt) {
     // Invalidate the TLB for this specific address
     asm volatile("invlpg (%0)" : : "r"(virt) : "memory");
 
-    spin_unlock(&vmm_lock);
+    spin_unlock_irqrestore(&vmm_lock, irq_flags);
 
     return phys_to_return;
 }
 
+/*
+Whether PML4 entry `index` of a user directory, holding `entry`, points at the same
+table as the kernel directory's, like the identity map every directory aliases.
+Such a table belongs to the kernel, and mapping user pages through it may well have
+set PAGE_USER on the entry, so only the table's address tells it apart.
+*/
+static inline bool vmm_is_kernel_table(uint32_t index, uint64_t entry) {
+    return (kernel_directory[index] & PAGE_PRESENT) && (entry & PAGE_MASK) == (kernel_directory[index] & PAGE_MASK);
+}
+
+/*
+Copy the lower half table `parent` at `level` (3 for a PML4 down to 0 for a PT),
+which maps from `virt_addr`, into the empty table `child`. Every level below gets
+a table of its own, but the frames are shared: each one gains a reference, and a
+writable one is made read-only with PAGE_COW in both, to be copied by
+vmm_resolve_cow on the first write. A frame without a Page descriptor cannot be
+shared like that, so it is copied here instead, and a large page holding one is
+split first. Returns false if a table or frame could not be allocated. The VMM
+lock must be held.
+*/
+static bool vmm_clone_table(uint64_t* parent, uint64_t* child, int level, uint64_t virt_addr) {
+    uint64_t span  = PAGE_SIZE << (9 * level);
+    uint32_t count = (level == 3) ? 256 : 512;
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t entry = parent[i];
+        uint64_t virt  = virt_addr + i * span;
+
+        if (!(entry & PAGE_PRESENT)) continue;
+
+        // Lower half tables that are not the process's own, like the identity map, stay shared
+        if (unlikely(level == 3 && vmm_is_kernel_table(i, entry))) {
+            child[i] = entry;
+            continue;
+        }
+
+        bool leaf = (level == 0) || (level < 3 && (entry & PAGE_HUGE));
+
+        if (leaf) {
+            uint64_t frame = entry & PAGE_MASK & ~(span - 1);
+            uint64_t pages = span / PAGE_SIZE;
+
+            if (likely(pmm_page((void*)(frame + span - PAGE_SIZE)) != NULL)) {
+                for (uint64_t p = 0; p < pages; p++) pmm_page_get(pmm_page((void*)(frame + p * PAGE_SIZE)));
+
+                if (entry & PAGE_RW) entry = (entry & ~PAGE_RW) | PAGE_COW;
+
+                parent[i] = entry;
+                child[i]  = entry;
+                continue;
+            }
+
+            if (level == 0) {
+                uint64_t copy = (uint64_t) pmm_alloc_page();
+                if (unlikely(copy == 0)) return false;
+
+                memcpy(PHYSICAL_TO_VIRTUAL(copy), PHYSICAL_TO_VIRTUAL(frame), PAGE_SIZE);
+                pmm_set_owner((void*) copy, 1, PAGE_OWNER_USER);
+
+                child[i] = copy | (entry & ~PAGE_MASK);
+                continue;
+            }
+
+            if (unlikely(!vmm_split_large(&parent[i], virt, span))) return false;
+            entry = parent[i];
+        }
+
+        uint64_t table_phys = (uint64_t) pmm_alloc_zeroed_page();
+        if (unlikely(table_phys == 0)) return false;
+
+        pmm_set_owner((void*) table_phys, 1, PAGE_OWNER_PAGE_TABLE);
+        child[i] = table_phys | (entry & ~PAGE_MASK);
+
+        uint64_t* parent_next = (uint64_t*) PHYSICAL_TO_VIRTUAL(entry & PAGE_MASK);
+        uint64_t* child_next  = (uint64_t*) PHYSICAL_TO_VIRTUAL(table_phys);
+
+        if (unlikely(!vmm_clone_table(parent_next, child_next, level - 1, virt))) return false;
+    }
+
+    return true;
+}
+
+/*
+Free every table below `table`, a page table structure at `level` (3 for the
+PML4, down to 0 for a PT), and drop a reference on every frame they map, so
+frames still shared with a fork or the zero frame survive. Lower half tables
+shared with the kernel directory are left alone. `table` itself is not freed.
+The VMM lock must be held.
+*/
+static void vmm_free_table(uint64_t* table, int level) {
+    uint64_t span  = PAGE_SIZE << (9 * level);
+    uint32_t count = (level == 3) ? 256 : 512;
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t entry = table[i];
+
+        if (!(entry & PAGE_PRESENT)) continue;
+        if (unlikely(level == 3 && vmm_is_kernel_table(i, entry))) continue;
+
+        table[i] = 0;
+
+        if (level == 0 || (level < 3 && (entry & PAGE_HUGE))) {
+            vmm_free_frames(entry & PAGE_MASK & ~(span - 1), span / PAGE_SIZE);
+            continue;
+        }
+
+        vmm_free_table((uint64_t*) PHYSICAL_TO_VIRTUAL(entry & PAGE_MASK), level - 1);
+        pmm_free_page((void*)(entry & PAGE_MASK));
+    }
+}
+
+/*
+Create a copy-on-write clone of the address space `pd_phys`, for fork. The higher
+half is shared as it is in every address space, and the lower half is copied with
+vmm_clone_table, which costs its page tables but none of its frames. Since the
+parent's writable pages turn read-only, its TLB is flushed if it is the one loaded.
+Returns the new PML4's physical address, or NULL if memory ran out, in which case
+whatever had been cloned so far is freed again.
+*/
+uint64_t* vmm_clone_address_space(uint64_t* pd_phys) {
+    uint64_t phys_pml4 = (uint64_t) pmm_alloc_zeroed_page();
+    if (unlikely(phys_pml4 == 0)) return NULL;
+
+    pmm_set_owner((void*) phys_pml4, 1, PAGE_OWNER_PAGE_TABLE);
+
+    uint64_t* parent_virt = (uint64_t*) PHYSICAL_TO_VIRTUAL(pd_phys);
+    uint64_t* child_virt  = (uint64_t*) PHYSICAL_TO_VIRTUAL(phys_pml4);
+
+    uint64_t irq_flags = spin_lock_irqsave(&vmm_lock);
+
+    for (int i = 256; i < 512; i++) {
+        child_virt[i] = parent_virt[i];
+    }
+
+    bool cloned = vmm_clone_table(parent_virt, child_virt, 3, 0);
+
+    if (vmm_get_current_directory() == pd_phys) vmm_flush_range(0, USER_SPACE_PAGES);
+
+    if (unlikely(!cloned)) vmm_free_table(child_virt, 3);
+
+    spin_unlock_irqrestore(&vmm_lock, irq_flags);
+
+    if (unlikely(!cloned)) {
+        pmm_free_page((void*) phys_pml4);
+        err_print("vmm_clone_address_space: out of memory");
+        return NULL;
+    }
+
+    return (uint64_t*) phys_pml4;
+}
+
+/*
+Tear down the user address space `pd_phys` once nothing will run in it again,
+such as when its task exits or execs. Every lower half table of its own goes back to
+the PMM along with the PML4 itself, and every mapped frame loses a reference. The
+identity map's tables are the kernel's, and stay. If it is
+loaded on this core, the kernel directory is switched to first. Any ASID a core
+still holds for it is released, so a PML4 later allocated from the same frame
+does not inherit its stale TLB entries.
+*/
+void vmm_destroy_address_space(uint64_t* pd_phys) {
+    uint64_t phys_kernel_directory = VIRTUAL_TO_PHYSICAL(kernel_directory);
+
+    if (unlikely(pd_phys == NULL || (uint64_t) pd_phys == phys_kernel_directory)) return;
+
+    if (vmm_get_current_directory() == pd_phys) vmm_switch_directory((uint64_t*) phys_kernel_directory);
+
+    uint64_t irq_flags = spin_lock_irqsave(&vmm_lock);
+    vmm_free_table((uint64_t*) PHYSICAL_TO_VIRTUAL(pd_phys), 3);
+    spin_unlock_irqrestore(&vmm_lock, irq_flags);
+
+    // Another core may be handing the slot to a new directory meanwhile, which must not be undone
+    for (uint32_t core = 0; core < MAX_CORES; core++) {
+        for (uint32_t asid = 1; asid < VMM_ASID_COUNT; asid++) {
+            uint64_t owner = (uint64_t) pd_phys;
+            __atomic_compare_exchange_n(&vmm_asid_owner[core][asid], &owner, 0, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        }
+    }
+
+    pmm_free_page(pd_phys);
+}
+
+/*
+Resolve a write to the copy-on-write page at `virt` in `pd_phys`. If nothing else
+shares the frame any more, the page is simply made writable again; otherwise its
+contents are copied into a frame of its own, and the shared one loses a reference.
+A large page is split first, so only the 4 KB written to is copied. Returns false
+if the page is not copy-on-write, or no frame was left for the copy.
+*/
+bool vmm_resolve_cow(uint64_t* pd_phys, void* virt) {
+    uint64_t virt_addr = (uint64_t) virt;
+
+    uint64_t pml4_idx = (virt_addr >> 39) & 0x1FF;
+    uint64_t pdpt_idx = (virt_addr >> 30) & 0x1FF;
+    uint64_t pd_idx   = (virt_addr >> 21) & 0x1FF;
+    uint64_t pt_idx   = (virt_addr >> 12) & 0x1FF;
+
+    bool resolved = false;
+
+    uint64_t irq_flags = spin_lock_irqsave(&vmm_lock);
+
+    uint64_t* pml4_virt = (uint64_t*) PHYSICAL_TO_VIRTUAL(pd_phys);
+    if (unlikely(!(pml4_virt[pml4_idx] & PAGE_PRESENT))) goto done;
+
+    uint64_t* pdpt_virt = (uint64_t*) PHYSICAL_TO_VIRTUAL(pml4_virt[pml4_idx] & PAGE_MASK);
+    uint64_t  pdpte     = pdpt_virt[pdpt_idx];
+
+    if (unlikely(!(pdpte & PAGE_PRESENT))) goto done;
+    if (unlikely(pdpte & PAGE_HUGE)) {
+        if (!(pdpte & PAGE_COW) || !vmm_split_large(&pdpt_virt[pdpt_idx], virt_addr, PAGE_SIZE_1G)) goto done;
+    }
+
+    uint64_t* pd_virt = (uint64_t*) PHYSICAL_TO_VIRTUAL(pdpt_virt[pdpt_idx] & PAGE_MASK);
+    uint64_t  pde     = pd_virt[pd_idx];
+
+    if (unlikely(!(pde & PAGE_PRESENT))) goto done;
+    if (unlikely(pde & PAGE_HUGE)) {
+        if (!(pde & PAGE_COW) || !vmm_split_large(&pd_virt[pd_idx], virt_addr, PAGE_SIZE_2M)) goto done;
+    }
+
+    uint64_t* pt_virt = (uint64_t*) PHYSICAL_TO_VIRTUAL(pd_virt[pd_idx] & PAGE_MASK);
+    uint64_t  pte     = pt_virt[pt_idx];
+
+    if (unlikely((pte & (PAGE_PRESENT | PAGE_COW)) != (PAGE_PRESENT | PAGE_COW))) goto done;
+
+    uint64_t frame = pte & PAGE_MASK;
+    uint64_t flags = (pte & ~PAGE_MASK & ~PAGE_COW) | PAGE_RW;
+    Page*    page  = pmm_page((void*) frame);
+
+    if (page != NULL && page->refcount == 1) {
+        pt_virt[pt_idx] = frame | flags;
+    } else {
+        uint64_t copy = (uint64_t) pmm_alloc_page();
+        if (unlikely(copy == 0)) goto done;
+
+        memcpy(PHYSICAL_TO_VIRTUAL(copy), PHYSICAL_TO_VIRTUAL(frame), PAGE_SIZE);
+        pmm_set_owner((void*) copy, 1, PAGE_OWNER_USER);
+
+        pt_virt[pt_idx] = copy | flags;
+        pmm_free_page((void*) frame);
+    }
+
+    asm volatile("invlpg (%0)" : : "r"(virt_addr) : "memory");
+    resolved = true;
+
+done:
+    spin_unlock_irqrestore(&vmm_lock, irq_flags);
+    return resolved;
+}
+
 /* Copy kernel directory into a new page */
 uint64_t* vmm_copy_kernel_directory() {
-    uint64_t phys_pml4 = (uint64_t) pmm_alloc_page();
+    uint64_t phys_pml4 = (uint64_t) pmm_alloc_zeroed_page();
     uint64_t* pml4_virt = (uint64_t*) PHYSICAL_TO_VIRTUAL(phys_pml4);
-    for (int i = 0; i < 512; i++) pml4_virt[i] = 0;
+    pmm_set_owner((void*) phys_pml4, 1, PAGE_OWNER_PAGE_TABLE);
 
-    spin_lock(&vmm_lock);
+    uint64_t irq_flags = spin_lock_irqsave(&vmm_lock);
 
     // Copy Higher-Half fields (Upper 256 entries in PML4 table)
     for (int i = 256; i < 512; i++) {
@@ -255,23 +953,53 @@ uint64_t* vmm_copy_kernel_directory() {
     // Maintain low-half shared initialization segments mapping
     pml4_virt[0] = kernel_directory[0];
 
-    spin_unlock(&vmm_lock);
+    spin_unlock_irqrestore(&vmm_lock, irq_flags);
 
     return (uint64_t*) phys_pml4;
 }
 
-/* Switch a new directory given the physical address */
+/*
+Switch a new directory given the physical address. With PCIDs, the directory is
+loaded under the ASID this core last gave it, with CR3_NOFLUSH set so the TLB
+entries it left behind are still there. A directory this core has not seen
+recently takes the next ASID round robin, and is loaded without CR3_NOFLUSH so
+whatever the ASID's previous owner left in the TLB is dropped.
+*/
 void vmm_switch_directory(uint64_t* page_directory) {
-    if (likely(vmm_get_current_directory() != page_directory)) {
+    if (unlikely(vmm_get_current_directory() == page_directory)) return;
+
+    if (unlikely(!vmm_has_pcid)) {
         asm volatile("mov %0, %%cr3" : : "r"(page_directory) : "memory");
+        return;
+    }
+
+    uint64_t irq_flags = save_disable_interrupts();
+
+    uint32_t  core   = get_core_id();
+    uint64_t* owners = vmm_asid_owner[core];
+    uint64_t  cr3    = (uint64_t) page_directory | CR3_NOFLUSH;
+
+    uint32_t asid = 0;
+    while (asid < VMM_ASID_COUNT && owners[asid] != (uint64_t) page_directory) asid++;
+
+    if (unlikely(asid == VMM_ASID_COUNT)) {
+        asid = vmm_asid_next[core] + 1;
+        vmm_asid_next[core] = asid % (VMM_ASID_COUNT - 1);
+
+        owners[asid] = (uint64_t) page_directory;
+        cr3 = (uint64_t) page_directory;
     }
+
+    asm volatile("mov %0, %%cr3" : : "r"(cr3 | asid) : "memory");
+
+    restore_interrupts(irq_flags);
 }
 
-/* Get the current page directory as a physical address */
+/* Get the current page directory as a physical address, without its ASID */
 uint64_t* vmm_get_current_directory() {
     uint64_t cr3;
     asm volatile("mov %%cr3, %0" : "=r"(cr3));
-    return (uint64_t*) cr3;
+    return (uint64_t*)(cr3 & PAGE_MASK);
 }
 
 /* Get the physical address of a virtual address */
@@ -283,7 +1011,7 @@ uint64_t vmm_get_phys(uint64_t* pd_phys, void* virt_addr) {
     uint64_t pd_idx   = (v >> 21) & 0x1FF;
     uint64_t pt_idx   = (v >> 12) & 0x1FF;
 
-    spin_lock(&vmm_lock);
+    uint64_t irq_flags = spin_lock_irqsave(&vmm_lock);
 
     uint64_t* pml4_virt = (uint64_t*) PHYSICAL_TO_VIRTUAL(pd_phys);
     if (unlikely(!(pml4_virt[pml4_idx] & PAGE_PRESENT))) goto fail;
@@ -291,19 +1019,33 @@ uint64_t vmm_get_phys(uint64_t* pd_phys, void* virt_addr) {
     uint64_t* pdpt_virt = (uint64_t*) PHYSICAL_TO_VIRTUAL(pml4_virt[pml4_idx] & PAGE_MASK);
     if (unlikely(!(pdpt_virt[pdpt_idx] & PAGE_PRESENT))) goto fail;
 
+    uint64_t phys_addr;
+
+    if (unlikely(pdpt_virt[pdpt_idx] & PAGE_HUGE)) {
+        phys_addr = (pdpt_virt[pdpt_idx] & PAGE_MASK & ~(PAGE_SIZE_1G - 1)) | (v & (PAGE_SIZE_1G - 1));
+        spin_unlock_irqrestore(&vmm_lock, irq_flags);
+        return phys_addr;
+    }
+
     uint64_t* pd_virt = (uint64_t*) PHYSICAL_TO_VIRTUAL(pdpt_virt[pdpt_idx] & PAGE_MASK);
     if (unlikely(!(pd_virt[pd_idx] & PAGE_PRESENT))) goto fail;
 
+    if (unlikely(pd_virt[pd_idx] & PAGE_HUGE)) {
+        phys_addr = (pd_virt[pd_idx] & PAGE_MASK & ~(PAGE_SIZE_2M - 1)) | (v & (PAGE_SIZE_2M - 1));
+        spin_unlock_irqrestore(&vmm_lock, irq_flags);
+        return phys_addr;
+    }
+
     uint64_t* pt_virt = (uint64_t*) PHYSICAL_TO_VIRTUAL(pd_virt[pd_idx] & PAGE_MASK);
     if (unlikely(!(pt_virt[pt_idx] & PAGE_PRESENT))) goto fail;
 
-    uint64_t phys_addr = (pt_virt[pt_idx] & PAGE_MASK) | (v & 0xFFF);
-    spin_unlock(&vmm_lock);
+    phys_addr = (pt_virt[pt_idx] & PAGE_MASK) | (v & 0xFFF);
+    spin_unlock_irqrestore(&vmm_lock, irq_flags);
 
     return phys_addr;
 
 fail:
-    spin_unlock(&vmm_lock);
+    spin_unlock_irqrestore(&vmm_lock, irq_flags);
     return 0;
 }
 
@@ -316,24 +1058,27 @@ int vmm_is_mapped(uint64_t* pd_phys, void* virt) {
     uint64_t pd_idx    = (virt_addr >> 21) & 0x1FF;
     uint64_t pt_idx    = (virt_addr >> 12) & 0x1FF;
 
-    spin_lock(&vmm_lock);
+    uint64_t irq_flags = spin_lock_irqsave(&vmm_lock);
 
     uint64_t* pml4_virt = (uint64_t*) PHYSICAL_TO_VIRTUAL(pd_phys);
     if (unlikely(!(pml4_virt[pml4_idx] & PAGE_PRESENT))) goto fail;
 
     uint64_t* pdpt_virt = (uint64_t*) PHYSICAL_TO_VIRTUAL(pml4_virt[pml4_idx] & PAGE_MASK);
     if (unlikely(!(pdpt_virt[pdpt_idx] & PAGE_PRESENT))) goto fail;
+    if (unlikely(pdpt_virt[pdpt_idx] & PAGE_HUGE)) goto mapped;
 
     uint64_t* pd_virt = (uint64_t*) PHYSICAL_TO_VIRTUAL(pdpt_virt[pdpt_idx] & PAGE_MASK);
     if (unlikely(!(pd_virt[pd_idx] & PAGE_PRESENT))) goto fail;
+    if (unlikely(pd_virt[pd_idx] & PAGE_HUGE)) goto mapped;
 
     uint64_t* pt_virt = (uint64_t*) PHYSICAL_TO_VIRTUAL(pd_virt[pd_idx] & PAGE_MASK);
     if (unlikely(!(pt_virt[pt_idx] & PAGE_PRESENT))) goto fail;
 
-    spin_unlock(&vmm_lock);
+mapped:
+    spin_unlock_irqrestore(&vmm_lock, irq_flags);
     return 1;
 
 fail:
-    spin_unlock(&vmm_lock);
+    spin_unlock_irqrestore(&vmm_lock, irq_flags);
     return 0;
 }
@@ -30,10 +30,13 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 typedef volatile uint32_t spinlock;
 
 extern uint8_t  core_apic_ids[MAX_CORES];
+extern uint8_t  core_apic_index[MAX_CORES];
 extern uint32_t core_count;
 
 void RARE_FUNC init_multicore();
 
+uint32_t FREQ_FUNC get_core_id();
+
 /* Lock given spinlock */
 static inline void spin_lock(spinlock *lock) {
     while (__sync_lock_test_and_set(lock, 1)) {
@@ -46,4 +49,21 @@ static inline void spin_unlock(spinlock *lock) {
     __sync_lock_release(lock);
 }
 
+/*
+Lock given spinlock with interrupts disabled, returning the flags to restore.
+Any lock also taken from an interrupt or fault handler must be taken this way
+everywhere, or a handler can spin forever on a holder it preempted.
+*/
+static inline uint64_t spin_lock_irqsave(spinlock *lock) {
+    uint64_t flags = save_disable_interrupts();
+    spin_lock(lock);
+    return flags;
+}
+
+/* Unlock given spinlock and restore the interrupt flags spin_lock_irqsave returned */
+static inline void spin_unlock_irqrestore(spinlock *lock, uint64_t flags) {
+    spin_unlock(lock);
+    restore_interrupts(flags);
+}
+
 #endif
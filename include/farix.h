@@ -27,6 +27,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "process/task.h"
 
 #define SYSCALL_FILENAME_LEN    32
+#define SYSCALL_HEAP_CLASSES    32
 
 #define SYS_DONE                0
 #define SYS_ERROR              -1
@@ -37,6 +38,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 // Default user system calls
 #define SYS_EXIT                USER_MIN_SYSCALL + 1 // NOTE: SYS_EXIT is hardcoded in user.asm, changing requires changing there
+#define SYS_FORK                USER_MIN_SYSCALL + 2
 #define SYS_EXECVE              USER_MIN_SYSCALL + 11
 
 // WIP
@@ -70,6 +72,8 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define SYS_GET_TASK_INFO       SUPER_MIN_SYSCALL + 10
 #define SYS_GET_TASK_LIST       SUPER_MIN_SYSCALL + 11
 #define SYS_TASK_KILL           SUPER_MIN_SYSCALL + 12
+#define SYS_HEAP_PROFILE        SUPER_MIN_SYSCALL + 13
+#define SYS_GET_HEAP_STATS      SUPER_MIN_SYSCALL + 14
 
 int64_t farix_syscall(uint64_t sys_id, uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5);
 
@@ -85,6 +89,24 @@ typedef struct {
     bool is_free;
 } HeapData;
 
+typedef struct {
+    uint32_t caller;
+    uint32_t allocs;
+    uint32_t live_count;
+    uint32_t live_bytes;
+    uint32_t peak_bytes;
+} HeapProfData;
+
+typedef struct {
+    uint32_t total;
+    uint32_t used;
+    uint32_t segments;
+    uint32_t vmalloc;
+    uint32_t allocs;
+    uint32_t frees;
+    uint32_t class_allocs[SYSCALL_HEAP_CLASSES];
+} HeapStatsData;
+
 typedef struct {
     uint32_t id;
     uint32_t state;
@@ -121,6 +143,7 @@ int   _fstat                (int file, struct stat *st);
 
 // TODO: fx_dirscan could optionally take in a starting point
 int fx_dirscan              (char* path, FileData* buffer, size_t count);
+int fx_fork                 ();
 
 // Super user functions
 
@@ -136,5 +159,7 @@ int SYSTEM_INT_OFF          ();
 int GET_TASK_DATA           (int pid, TaskData* buffer);
 int GET_TASK_LIST           (int list_id, TaskListData* buffer);
 int TASK_KILL               (int pid);
+int HEAP_PROFILE            (HeapProfData* buffer, int max_count);
+int GET_HEAP_STATS          (HeapStatsData* buffer);
 
 #endif
@@ -24,6 +24,8 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "hal.h"
+
 #include "process/task.h"
 
 #define ELFCLASS64  2
@@ -67,5 +69,6 @@ void elf_user_trampoline();
 
 task* exec_elf(const char* path);
 bool  exec_elf_inplace(const char* path, task* t);
+task* fork_elf(task* parent, const syscalls_registers_x86_64_t* regs);
 
 #endif
@@ -53,8 +53,14 @@ typedef struct {
 
 extern VFS* current_vfs;
 
+void RARE_FUNC init_vfs  ();
 void RARE_FUNC vfs_mount (VFS* ops);
 
+File*     fs_alloc_file ();
+void      fs_free_file  (File* file);
+FileNode* fs_alloc_node ();
+void      fs_free_node  (FileNode* node);
+
 int       fs_read   (const char* name, void* buffer, size_t size, uint64_t offset);
 int       fs_write  (const char* name, const void* buffer, size_t size, uint64_t offset);
 int       fs_create (const char* name);
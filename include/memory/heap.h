@@ -23,6 +23,9 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #define HEAP_MAGIC 0x12345678
 
+// Free segments are kept on power-of-two size class lists, from 16 bytes upwards
+#define HEAP_CLASS_COUNT 32
+
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -34,8 +37,27 @@ typedef struct HeapSegment {
     uint32_t magic;
     uint32_t caller;
     bool is_free;
+    bool in_magazine;   // Freed into a per-core magazine, so still off the free lists
+    uint8_t prof_epoch; // Profiler epoch the segment was allocated in, 0 if untracked
 } __attribute__((aligned(4))) HeapSegment;
 
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint32_t cached;
+} HeapMagazineStats;
+
+typedef struct {
+    size_t   total;
+    size_t   used;     // Handed out and not freed, so blocks idle in magazines are left out
+    size_t   cached;   // Freed blocks held in the per-core magazines
+    size_t   segments;
+    size_t   vmalloc;
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t class_allocs[HEAP_CLASS_COUNT]; // kmalloc requests by the size class they round up to
+} HeapStats;
+
 extern void*        heap_start;
 extern void*        heap_end;
 extern HeapSegment* first_segment;
@@ -44,8 +66,14 @@ void RARE_FUNC init_heap();
 
 void*  kmalloc(size_t size);
 void   kfree(void* ptr);
+void*  krealloc(void* ptr, size_t size);
+size_t ksize(void* ptr);
+
+bool   kheap_expand(size_t size);
+size_t kheap_trim();
 
-void   kheap_expand(size_t size);
+void   heap_magazine_stats(uint32_t core, HeapMagazineStats* out);
+void   heap_get_stats(HeapStats* out);
 
 size_t RARE_FUNC get_heap_total();
 size_t RARE_FUNC get_heap_used();
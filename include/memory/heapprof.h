@@ -0,0 +1,58 @@
+/*
+-----------------------------------------------------------------------
+Farix Operating System
+Copyright (C) 2026  Faris Muhammad
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+-----------------------------------------------------------------------
+*/
+
+#ifndef HEAPPROF_H
+#define HEAPPROF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define HEAP_PROF_SITES   256 // Distinct call sites tracked at once
+#define HEAP_PROF_LARGE   128 // Live vmalloc-backed allocations tracked at once
+#define HEAP_PROF_TOP_MAX 32  // Most sites a single top-N query returns
+
+typedef struct {
+    uint32_t caller;
+    uint32_t allocs;
+    uint32_t live_count;
+    uint64_t live_bytes;
+    uint64_t peak_bytes;
+} HeapProfSite;
+
+extern volatile bool    heap_prof_enabled;
+extern volatile uint8_t heap_prof_epoch;
+
+void heap_prof_start();
+void heap_prof_stop();
+void heap_prof_reset();
+
+void heap_prof_alloc(uint32_t caller, size_t size);
+void heap_prof_free(uint32_t caller, size_t size);
+void heap_prof_resize(uint32_t caller, size_t old_size, size_t new_size);
+
+void heap_prof_alloc_large(void* ptr, uint32_t caller, size_t size);
+void heap_prof_free_large(void* ptr);
+void heap_prof_resize_large(void* ptr, size_t size);
+
+uint32_t RARE_FUNC heap_prof_top(HeapProfSite* out, uint32_t max);
+uint32_t RARE_FUNC heap_prof_dropped();
+
+#endif
@@ -21,18 +21,75 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #ifndef PMM_H
 #define PMM_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
-#define PAGE_SIZE       4096
-// 64 bits per entry. To track 128 GB of RAM:
-// (128 * 1024 * 1024 * 1024) / 4096 bytes per page / 64 bits per entry = 524,288 entries
-#define PMM_BITMAP_SIZE 524288
+#define PAGE_SIZE 4096
+
+// Biggest buddy block is 2^10 pages (4 MB)
+#define PMM_MAX_ORDER 10
+
+// NUMA nodes taken from the SRAT, any domains past this are left out
+#define PMM_MAX_NODES 8
+
+// Who a frame was handed out to, in Page.owner
+#define PAGE_OWNER_NONE       0
+#define PAGE_OWNER_PAGE_TABLE 1
+#define PAGE_OWNER_HEAP       2
+#define PAGE_OWNER_SLAB       3
+#define PAGE_OWNER_VMALLOC    4
+#define PAGE_OWNER_USER       5
+
+// Page.flags
+#define PAGE_FLAG_RESERVED (1 << 0) // In use from boot: BIOS area, kernel image, PMM metadata, holes
+
+/*
+Descriptor of one physical frame, in an array indexed by page number. A frame
+has a refcount of 1 once allocated, and is only freed when the last holder
+lets go of it. `link` is for whoever owns the frame to chain it into a list.
+*/
+typedef struct Page {
+    uint32_t     refcount;
+    uint16_t     owner;
+    uint16_t     flags;
+    struct Page* link;
+} Page;
+
+typedef struct {
+    size_t free_pages;                     // Free in the bitmap, not counting the frame caches
+    size_t cached_pages;                   // Free pages parked in the per-core frame caches
+    size_t free_blocks[PMM_MAX_ORDER + 1]; // Free blocks of each order
+} PmmBuddyStats;
+
+typedef struct {
+    uint32_t domain;      // ACPI proximity domain
+    size_t   free_pages;  // Free in the bitmap, not counting the frame caches
+    size_t   total_pages; // Pages of RAM the SRAT gives the node
+} PmmNodeStats;
 
 void RARE_FUNC init_pmm();
+void RARE_FUNC init_pmm_numa();
 
 void* pmm_alloc_page();
 void* pmm_alloc_pages(size_t length);
 void  pmm_free_page(void* addr);
+void  pmm_free_pages(void* addr, size_t length);
+
+void* pmm_alloc_order(uint32_t order);
+void  pmm_free_order(void* addr, uint32_t order);
+
+size_t pmm_get_free_pages();
+size_t pmm_get_total_pages();
+void   pmm_get_buddy_stats(PmmBuddyStats* stats);
+
+Page* pmm_page(void* addr);
+void* pmm_page_addr(Page* page);
+void  pmm_page_get(Page* page);
+bool  pmm_page_put(Page* page);
+void  pmm_set_owner(void* addr, size_t length, uint16_t owner);
+
+uint32_t pmm_get_node_count();
+bool     pmm_get_node_stats(uint32_t node, PmmNodeStats* stats);
 
 #endif
@@ -21,79 +21,66 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #ifndef SLAB_H
 #define SLAB_H
 
-#define SLAB64_MAGIC 0x51AB6464
-#define SLAB32_MAGIC 0x51AB3232
-#define SLAB16_MAGIC 0x51AB1616
-#define SLAB8_MAGIC  0x51AB0808
+#include <stddef.h>
+#include <stdint.h>
 
-#define IS_SLAB(magic) (((magic) & 0xFFFF0000) == 0x51AB0000)
+#include "cpu/multicore.h"
 
-typedef struct Slab64 {
+#define KMEM_SLAB_MAGIC      0x51AB51AB
+#define KMEM_NAME_LEN        32
+#define KMEM_MAX_OBJECT_SIZE 1024 // Every slab is one page, so it still holds a few of these
+#define KMEM_EMPTY_RESERVE   2    // Completely free slabs a cache holds on to before giving pages back
+#define KMEM_CACHE_LINE      64   // Alignment for objects that should not share or straddle a cache line
+
+typedef struct KmemSlab {
     uint32_t magic;
-    uint64_t mask;
-    uint64_t free_slots;
-    uint16_t obj_shift;
+    uint16_t free_count;
+    uint16_t free_head; // Index of the first free object, KMEM_NONE if there is none
 
-    struct Slab64* next;
-    struct Slab64* prev;
+    struct KmemCache* cache;
 
-    char data[] __attribute__((aligned(8)));
-} __attribute__((aligned(64))) Slab64;
+    struct KmemSlab* next;
+    struct KmemSlab* prev;
 
-typedef struct Slab32 {
-    uint32_t magic;
-    uint32_t mask;
-    uint32_t free_slots;
-    uint16_t obj_shift;
+    // Next free object per object. Kept out of line, so a free object is never
+    // written to and stays in the state its constructor left it in.
+    uint16_t free_next[];
+} KmemSlab;
 
-    struct Slab32* next;
-    struct Slab32* prev;
+typedef struct KmemCache {
+    char name[KMEM_NAME_LEN];
 
-    char data[] __attribute__((aligned(8)));
-} __attribute__((aligned(64))) Slab32;
+    uint32_t object_size; // Size of one object, rounded up to the alignment
+    uint32_t align;
+    uint32_t objects_per_slab;
+    uint32_t data_offset; // Offset of the first object from the start of its slab
 
-typedef struct Slab16 {
-    uint32_t magic;
-    uint16_t mask;
-    uint16_t free_slots;
-    uint16_t obj_shift;
+    void (*ctor)(void*);
 
-    struct Slab16* next;
-    struct Slab16* prev;
+    // Every slab is on exactly one of these, by how many free objects it has
+    KmemSlab* slabs_partial;
+    KmemSlab* slabs_full;
+    KmemSlab* slabs_empty;
 
-    char data[] __attribute__((aligned(8)));
-} __attribute__((aligned(64))) Slab16;
+    uint64_t  slab_count;
+    uint64_t  empty_count;
+    uint64_t  active_objects;
 
-typedef struct Slab8 {
-    uint32_t magic;
-    uint8_t mask;
-    uint8_t free_slots;
-    uint16_t obj_shift;
-
-    struct Slab8* next;
-    struct Slab8* prev;
-
-    char data[] __attribute__((aligned(8)));
-} __attribute__((aligned(64))) Slab8;
-
-Slab64* create_slab64 (uint16_t object_size);
-Slab32* create_slab32 (uint16_t object_size);
-Slab16* create_slab16 (uint16_t object_size);
-Slab8*  create_slab8  (uint16_t object_size);
-
-void    delete_slab64 (Slab64* slab);
-void    delete_slab32 (Slab32* slab);
-void    delete_slab16 (Slab16* slab);
-void    delete_slab8  (Slab8*  slab);
-
-void*   slab_alloc64  (Slab64* head);
-void*   slab_alloc32  (Slab32* head);
-void*   slab_alloc16  (Slab16* head);
-void*   slab_alloc8   (Slab8*  head);
-
-void    slab_free64   (void* ptr);
-void    slab_free32   (void* ptr);
-void    slab_free16   (void* ptr);
-void    slab_free8    (void* ptr);
+    spinlock lock;
+
+    struct KmemCache* next;
+} KmemCache;
+
+extern KmemCache* kmem_caches;
+
+KmemCache* kmem_cache_create(const char* name, size_t size, size_t align, void (*ctor)(void*));
+void       kmem_cache_destroy(KmemCache* cache);
+void       kmem_cache_shrink(KmemCache* cache);
+void       kmem_reap();
+
+void*      kmem_cache_alloc(KmemCache* cache);
+void       kmem_cache_free(KmemCache* cache, void* ptr);
+
+KmemCache* kmem_cache_of(void* ptr);
 
 #endif
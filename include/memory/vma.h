@@ -0,0 +1,55 @@
+/*
+-----------------------------------------------------------------------
+Farix Operating System
+Copyright (C) 2026  Faris Muhammad
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+-----------------------------------------------------------------------
+*/
+
+#ifndef VMA_H
+#define VMA_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "process/task.h"
+
+#define VMA_WRITE (1 << 0) // Pages are mapped writable
+#define VMA_STACK (1 << 1) // Grows down into the gap below it when that is touched
+
+#define VMA_STACK_MAX 0x800000ULL // 8 MB, the furthest a stack grows down from its top
+
+#define PAGE_FAULT_PRESENT (1 << 0) // The page was mapped, and the access broke its protection
+#define PAGE_FAULT_WRITE   (1 << 1)
+#define PAGE_FAULT_USER    (1 << 2)
+
+// A page-aligned range of a process's address space, backed on first touch
+typedef struct Vma {
+    uint64_t start; // First byte
+    uint64_t end;   // One past the last byte
+    uint32_t flags;
+    struct Vma* next; // Sorted by start
+} Vma;
+
+void RARE_FUNC init_vma();
+
+Vma* vma_add(Vma** vmas, uint64_t start, uint64_t end, uint32_t flags);
+Vma* vma_find(Vma* vmas, uint64_t addr);
+void vma_free_all(Vma** vmas);
+bool vma_copy_all(Vma** dst, Vma* src);
+
+bool vma_handle_fault(task* t, uint64_t addr, uint64_t err_code);
+
+#endif
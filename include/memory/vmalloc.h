@@ -0,0 +1,40 @@
+/*
+-----------------------------------------------------------------------
+Farix Operating System
+Copyright (C) 2026  Faris Muhammad
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+-----------------------------------------------------------------------
+*/
+
+#ifndef VMALLOC_H
+#define VMALLOC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "memory/vmm.h"
+
+#define IS_VMALLOC(addr) ((uint64_t)(addr) - VMALLOC_START < VMALLOC_SIZE)
+
+void* vmalloc(size_t size);
+void  vfree(void* ptr);
+
+bool   vmalloc_resize(void* ptr, size_t size);
+size_t vmalloc_size(void* ptr);
+
+size_t RARE_FUNC get_vmalloc_used();
+
+#endif
@@ -24,13 +24,29 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <stdbool.h>
 #include <stdint.h>
 
-#define VMM_INIT_MAP_SIZE_MB 32
+#define VMM_INIT_MAP_SIZE_MB 16 // Kernel image window at PAGE_OFFSET, and the identity map
 
 #define PAGE_OFFSET    0xFFFFFFFF80000000ULL
+#define HEAP_START     (PAGE_OFFSET + ((uint64_t) VMM_INIT_MAP_SIZE_MB << 20))
 #define USER_STACK_TOP 0x00007FFFFFFFF000ULL
 
-#define PHYSICAL_TO_VIRTUAL(addr) ((void*)((uint64_t)(addr) + PAGE_OFFSET))
-#define VIRTUAL_TO_PHYSICAL(addr) ((uint64_t)(uintptr_t)(addr) - PAGE_OFFSET)
+// Kernel virtual range for page-granular allocations, just below the kernel
+// image. It lives in the top PML4 slot, so every address space shares it.
+#define VMALLOC_START  0xFFFFFFFF00000000ULL
+#define VMALLOC_SIZE   0x0000000040000000ULL // 1 GB
+
+// Every byte of RAM is mapped once here at boot, in PML4 slot 256, so that any
+// physical page can be reached through PHYSICAL_TO_VIRTUAL without mapping it.
+#define DIRECT_MAP_BASE 0xFFFF800000000000ULL
+
+#define PAGE_SIZE_2M   0x0000000000200000ULL
+#define PAGE_SIZE_1G   0x0000000040000000ULL
+
+// Kernel image symbols live at PAGE_OFFSET, everything else goes through the direct map.
+// Heap and vmalloc pages are mapped one frame at a time, so those need vmm_get_phys instead.
+#define PHYSICAL_TO_VIRTUAL(addr) ((void*)((uint64_t)(addr) + DIRECT_MAP_BASE))
+#define VIRTUAL_TO_PHYSICAL(addr) ((uint64_t)(uintptr_t)(addr) - \
+    (((uint64_t)(uintptr_t)(addr) >= PAGE_OFFSET) ? PAGE_OFFSET : DIRECT_MAP_BASE))
 
 extern const uint64_t PAGE_PRESENT;
 extern const uint64_t PAGE_RW;
@@ -38,15 +54,24 @@ extern const uint64_t PAGE_USER;
 extern const uint64_t PAGE_CACHE;
 extern const uint64_t PAGE_PWT;
 extern const uint64_t PAGE_PCD;
+extern const uint64_t PAGE_HUGE;
+extern const uint64_t PAGE_GLOBAL;
+extern const uint64_t PAGE_COW;
 
 extern uint64_t* kernel_directory;
 
 void RARE_FUNC init_vmm();
 
-void     vmm_map_page(uint64_t* pd_phys, void* phys, void* virt, uint64_t flags);
+bool     vmm_map_page(uint64_t* pd_phys, void* phys, void* virt, uint64_t flags);
+bool     vmm_map_range(uint64_t* pd_phys, void* phys, void* virt, uint64_t count, uint64_t flags);
+bool     vmm_map_large(uint64_t* pd_phys, void* phys, void* virt, uint64_t size, uint64_t flags);
 uint64_t vmm_unmap_page(void* virt);
+bool     vmm_unmap_range(uint64_t* pd_phys, void* virt, uint64_t count, bool free_frames);
+bool     vmm_resolve_cow(uint64_t* pd_phys, void* virt);
 
 uint64_t* RARE_FUNC vmm_copy_kernel_directory();
+uint64_t* RARE_FUNC vmm_clone_address_space(uint64_t* pd_phys);
+void      RARE_FUNC vmm_destroy_address_space(uint64_t* pd_phys);
 void      RARE_FUNC vmm_switch_directory(uint64_t* page_directory);
 
 uint64_t* RARE_FUNC vmm_get_current_directory();
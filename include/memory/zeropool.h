@@ -0,0 +1,42 @@
+/*
+-----------------------------------------------------------------------
+Farix Operating System
+Copyright (C) 2026  Faris Muhammad
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+-----------------------------------------------------------------------
+*/
+
+#ifndef ZEROPOOL_H
+#define ZEROPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ZERO_POOL_SIZE  128 // Pre-zeroed frames kept ready
+#define ZERO_POOL_BATCH 16  // Frames zeroed per pass before the zeroing task yields
+
+typedef struct {
+    size_t   cached; // Zeroed frames waiting in the pool
+    uint64_t hits;   // pmm_alloc_zeroed_page calls served from the pool
+    uint64_t misses; // Calls that found it empty and cleared a frame inline
+} ZeroPoolStats;
+
+void* pmm_alloc_zeroed_page();
+void  zero_pool_drain();
+
+void RARE_FUNC zero_pool_thread();
+void RARE_FUNC zero_pool_stats(ZeroPoolStats* stats);
+
+#endif
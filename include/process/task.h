@@ -50,6 +50,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
     #error "task.h: macro TASKS_LIST_LEN must be 8, 16, 32, or 64 exactly"
 #endif
 
+// Everything schedule() touches sits in the first cache line
 typedef struct task {
     struct task* next;        // Next child task
     struct task* parent;      // Caller
@@ -57,20 +58,21 @@ typedef struct task {
     uint64_t id;              // Thread ID (Scaled to 64-bit)
     uint64_t stack_pointer;   // Current RSP (Changed from uint32_t)
     uint64_t* page_directory; // 0 -> kernel_directory PML4 (Changed from uint32_t*)
-    uint64_t heap_break;      // Limit for malloc (Changed from uint32_t)
     uint64_t state;           // Running, Ready, etc. (Changed from uint32_t)
     uint64_t* stack_origin;   // Memory allocated for the stack (Changed from uint32_t*)
+    uint64_t heap_break;      // Limit for malloc (Changed from uint32_t)
     void (*entry_func)(void* args);
     void* args;
     int privilege;
     const char* name;
-} task;
+    struct Vma* vmas;         // Demand paged areas of a user address space, sorted by start
+} __attribute__((aligned(64))) task;
 
 typedef struct task_list {
     task* tasks[TASKS_LIST_LEN];
     task_list_mask_t mask;
     struct task_list* next;
-} task_list;
+} __attribute__((aligned(64))) task_list;
 
 extern task* main_task;
 extern task* current_task;
@@ -82,6 +84,7 @@ void RARE_FUNC init_multitasking();
 
 task* RARE_FUNC create_task(void (*entry_point)(void*), const char* name, const int privilege, void* args);
 void  RARE_FUNC kill_task(uint64_t id);
+void  RARE_FUNC task_reaper_thread();
 
 void FREQ_FUNC schedule();
 
@@ -41,6 +41,9 @@ void cmd_echo(const char* args);
 void cmd_secho(const char* args);
 void cmd_memstat(const char* args);
 void cmd_heapstat(const char* args);
+void cmd_heapmag(const char* args);
+void cmd_heapprof(const char* args);
+void cmd_buddyinfo(const char* args);
 void cmd_int(const char* args);
 
 // fs
@@ -38,10 +38,8 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define OS_SLEEP_MAX_MICROSECONDS 3000000
 #define MAX_DEFERRED_UNMAPS 64
 
-#define ACPI_SLAB64_SIZE PAGE_SIZE >> 6
-#define ACPI_SLAB32_SIZE PAGE_SIZE >> 5
-#define ACPI_SLAB16_SIZE PAGE_SIZE >> 4
-#define ACPI_SLAB8_SIZE  PAGE_SIZE >> 3
+#define ACPI_POOL_COUNT    4
+#define ACPI_POOL_MIN_SIZE 64 // Pools hold 64, 128, 256 and 512 byte objects
 
 typedef struct {
     uint32_t units;
@@ -54,27 +52,25 @@ static size_t unmap_count = 0;
 
 static ACPI_PHYSICAL_ADDRESS AcpiRSDP = 0;
 
-static Slab64* acpi_slab_head64 = NULL;
-static Slab32* acpi_slab_head32 = NULL;
-static Slab16* acpi_slab_head16 = NULL;
-static Slab8*  acpi_slab_head8  = NULL;
+static KmemCache* acpi_pools[ACPI_POOL_COUNT];
 
 // --- INITIALISATION ---
 
 void init_acpi_slabs() {
-    acpi_slab_head64 = create_slab64(ACPI_SLAB64_SIZE);
-    acpi_slab_head32 = create_slab32(ACPI_SLAB32_SIZE);
-    acpi_slab_head16 = create_slab16(ACPI_SLAB16_SIZE);
-    acpi_slab_head8  = create_slab8(ACPI_SLAB8_SIZE);
+    static const char* names[ACPI_POOL_COUNT] = {"acpi-64", "acpi-128", "acpi-256", "acpi-512"};
 
-    if (unlikely(!acpi_slab_head64 || !acpi_slab_head32 || !acpi_slab_head16 || !acpi_slab_head8)) {
-        err_print("AcpiOsInitialize: Failed to initialize slab pools");
+    for (int i = 0; i < ACPI_POOL_COUNT; i++) {
+        acpi_pools[i] = kmem_cache_create(names[i], ACPI_POOL_MIN_SIZE << i, 8, NULL);
+
+        if (unlikely(!acpi_pools[i])) {
+            err_print("AcpiOsInitialize: Failed to initialize slab pools");
+        }
     }
 }
 
 /*
-Initialises the ACPICA by creating four slabs, each used for differently sized
-allocations, then finding the RSDP, i.e. the "Root System Description Pointer"
+Initialises the ACPICA by finding the RSDP, i.e. the "Root System Description
+Pointer". The object pools it allocates from are set up by init_acpi_slabs.
 */
 ACPI_STATUS AcpiOsInitialize() {
     AcpiRSDP = AcpiOsGetRootPointer();
@@ -238,9 +234,10 @@ void* AcpiOsMapMemory(ACPI_PHYSICAL_ADDRESS PhysicalAddress, ACPI_SIZE Length) {
     for (uintptr_t page = base_page; page <= last_page; page += 0x1000) {
         void* virt_page = (void*) PHYSICAL_TO_VIRTUAL(page);
 
-        if (!vmm_is_mapped((uint64_t*) VIRTUAL_TO_PHYSICAL(kernel_directory), virt_page)) {
-            vmm_map_page((uint64_t*) VIRTUAL_TO_PHYSICAL(kernel_directory),
-                (void*) page, virt_page, PAGE_PRESENT | PAGE_RW);
+        if (!vmm_is_mapped((uint64_t*) VIRTUAL_TO_PHYSICAL(kernel_directory), virt_page)
+            && unlikely(!vmm_map_page((uint64_t*) VIRTUAL_TO_PHYSICAL(kernel_directory),
+                (void*) page, virt_page, PAGE_PRESENT | PAGE_RW))) {
+            return NULL;
         }
     }
 
@@ -288,16 +285,11 @@ If the allocation fails due to insufficient heap space, it returns NULL. It must
 void* AcpiOsAllocate(ACPI_SIZE Size) {
     void* ptr = NULL;
 
-    // We check from smallest capacity (large objects) to largest capacity (small objects)
+    // Smallest power of two pool the object fits in
+    int pool = (Size <= ACPI_POOL_MIN_SIZE) ? 0 : 64 - __builtin_clzll((Size - 1) / ACPI_POOL_MIN_SIZE);
 
-    if (Size <= ACPI_SLAB64_SIZE) {
-        ptr = slab_alloc64(acpi_slab_head64);
-    } else if (Size <= ACPI_SLAB32_SIZE) {
-        ptr = slab_alloc32(acpi_slab_head32);
-    } else if (Size <= ACPI_SLAB16_SIZE) {
-        ptr = slab_alloc16(acpi_slab_head16);
-    } else if (Size <= ACPI_SLAB8_SIZE) {
-        ptr = slab_alloc8(acpi_slab_head8);
+    if (likely(pool < ACPI_POOL_COUNT)) {
+        ptr = kmem_cache_alloc(acpi_pools[pool]);
     } else {
         // Fallback for stuff we can't slab
         ptr = kmalloc(Size);
@@ -316,23 +308,11 @@ ACPI subsystem.
 void AcpiOsFree(void *Memory) {
     if (unlikely(!Memory)) return;
 
-    uintptr_t addr = (uintptr_t) Memory;
-    uintptr_t page_base = addr & ~(uintptr_t) 0xFFF;
-
-    // Cast it to a generic Slab pointer to check the magic
-    // We can use Slab8 as a template since magic is at the same offset in all of them
-    Slab8* slab = (Slab8*) page_base;
-
-    if (likely(IS_SLAB(slab->magic))) {
-        switch (slab->magic) {
-            case SLAB64_MAGIC :  slab_free64(Memory); break;
-            case SLAB32_MAGIC :  slab_free32(Memory); break;
-            case SLAB16_MAGIC :  slab_free16(Memory); break;
-            case SLAB8_MAGIC  :  slab_free8(Memory);  break;
-            default:
-                err_print("AcpiOsFree: Invalid slab magic");
-                break;
-        }
+    // Pool objects and the kmalloc fallback both end up here
+    KmemCache* cache = kmem_cache_of(Memory);
+
+    if (likely(cache != NULL)) {
+        kmem_cache_free(cache, Memory);
     }
     else {
         kfree(Memory);
@@ -346,10 +326,12 @@ provides a handle to the new cache via a pointer. This optimization reduces frag
 overhead during frequent interpreter allocations.
 */
 ACPI_STATUS AcpiOsCreateCache(char *CacheName, UINT16 ObjectSize, UINT16 MaxDepth, ACPI_CACHE_T **ReturnCache) {
-    if (unlikely(!ReturnCache || ObjectSize == 0)) return AE_BAD_PARAMETER;
+    if (unlikely(!ReturnCache || ObjectSize == 0 || ObjectSize > KMEM_MAX_OBJECT_SIZE)) return AE_BAD_PARAMETER;
 
-    // We use the Size as the handle.
-    *ReturnCache = (ACPI_CACHE_T*)(uintptr_t) ObjectSize;
+    KmemCache* cache = kmem_cache_create(CacheName, ObjectSize, 8, NULL);
+    if (unlikely(!cache)) return AE_NO_MEMORY;
+
+    *ReturnCache = (ACPI_CACHE_T*) cache;
 
     return AE_OK;
 }
@@ -360,6 +342,7 @@ a pointer to the cache handle as input and returns an ACPI_STATUS code. This ope
 the memory associated with unused objects in the cache without destroying the cache object itself.
 */
 ACPI_STATUS AcpiOsPurgeCache(ACPI_CACHE_T *Cache) {
+    if (likely(Cache)) kmem_cache_shrink((KmemCache*) Cache);
     return AE_OK;
 }
 
@@ -370,6 +353,7 @@ deletion, the function ensures all cached objects are freed to the system heap,
 the cache handle.
 */
 ACPI_STATUS AcpiOsDeleteCache(ACPI_CACHE_T *Cache) {
+    if (likely(Cache)) kmem_cache_destroy((KmemCache*) Cache);
     return AE_OK;
 }
 
@@ -412,7 +396,12 @@ cache is empty, the function typically allocates a new object from the system he
 fulfill the request.
 */
 void * AcpiOsAcquireObject(ACPI_CACHE_T *Cache) {
-    return AcpiOsAllocate((uintptr_t) Cache);
+    KmemCache* cache = (KmemCache*) Cache;
+
+    void* ptr = kmem_cache_alloc(cache);
+    if (likely(ptr)) memset(ptr, 0, cache->object_size);
+
+    return ptr;
 }
 
 /*
@@ -422,7 +411,7 @@ released. It returns an ACPI_STATUS code to indicate whether the object was succ
 reintegrated into the cache pool.
 */
 ACPI_STATUS AcpiOsReleaseObject(ACPI_CACHE_T *Cache, void *Object) {
-    AcpiOsFree(Object);
+    kmem_cache_free((KmemCache*) Cache, Object);
     return AE_OK;
 }
 
@@ -500,7 +489,7 @@ to protect small, critical sections of code where blocking is not permitted, ens
 at the hardware level.
 */
 ACPI_STATUS AcpiOsCreateLock(ACPI_SPINLOCK *OutHandle) {
-    void* lock = slab_alloc64(acpi_slab_head64);
+    void* lock = kmem_cache_alloc(acpi_pools[0]);
     if (unlikely(!lock)) return AE_NO_MEMORY;
 
     *(uint32_t*) lock = 0;
@@ -516,7 +505,7 @@ when the lock is no longer required and is not currently held by any processor.
 */
 void AcpiOsDeleteLock(ACPI_SPINLOCK Handle) {
     if (likely(Handle)) {
-        slab_free64((void*) Handle);
+        kmem_cache_free(acpi_pools[0], (void*) Handle);
     }
 }
 
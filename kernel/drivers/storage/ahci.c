@@ -418,9 +418,6 @@ void init_ahci(pci_device_t* dev) {
                 continue;
             }
 
-            vmm_map_page((uint64_t*) VIRTUAL_TO_PHYSICAL(kernel_directory),
-                (void*) port_phys, (void*) port_virt,
-                PAGE_PRESENT | PAGE_RW | PAGE_PCD | PAGE_PWT);
             memset((void*) port_virt, 0, PAGE_SIZE);
 
             port->clb  = (uint32_t)(port_phys & 0xFFFFFFFF);
@@ -435,14 +432,6 @@ void init_ahci(pci_device_t* dev) {
                 continue;
             }
 
-            // Map the 2 pages
-            for (int j = 0; j < 2; j++) {
-                vmm_map_page((uint64_t*) VIRTUAL_TO_PHYSICAL(kernel_directory),
-                    (void*)(cmd_tables_phys + (PAGE_SIZE * j)),
-                    (void*)(cmd_tables_virt + (PAGE_SIZE * j)),
-                    PAGE_PRESENT | PAGE_RW | PAGE_PCD | PAGE_PWT);
-            }
-
             memset((void*) cmd_tables_virt, 0, PAGE_SIZE * 2);
 
             hba_cmd_header_t* headers = (hba_cmd_header_t*) port_virt;
@@ -995,8 +995,8 @@ File* fat32_get(const char* name) {
 search_done:
     if (unlikely(!entry_found)) return NULL;
 
-    File* f = (File*) kmalloc(sizeof(File));
-    memset(f, 0, sizeof(File));
+    File* f = fs_alloc_file();
+    if (unlikely(!f)) return NULL;
 
     f->name = name;
     f->is_directory = (found_entry.attributes & 0x10);
@@ -1069,9 +1069,8 @@ FileNode* fat32_getall(const char* path) {
                             (entries[i].attributes & 0x08) ||
                              entries[i].name[0] == '.')) continue;
 
-                FileNode* newNode = (FileNode*) kmalloc(sizeof(FileNode));
+                FileNode* newNode = fs_alloc_node();
                 if (unlikely(!newNode)) return head;
-                memset(newNode, 0, sizeof(FileNode));
 
                 newNode->file.size = entries[i].size;
                 newNode->file.is_directory = (entries[i].attributes & 0x10);
@@ -138,15 +138,13 @@ static File* create_new_ramdisk_file(const char* name) {
         current_ramfile_at_index->next = new_ramfile;
     }
 
-    File* new_file = (File*) kmalloc(sizeof(File));
+    File* new_file = fs_alloc_file();
 
     if (unlikely(!new_file)) {
         err_printf("ramdisk_create: Out of memory for file creating file %s", name);
         return NULL;
     }
 
-    memset(new_file, 0, sizeof(File));
-
     new_ramfile->file = new_file;
 
     return new_file;
@@ -186,20 +184,21 @@ int ramdisk_write(const char* name, const void* buffer, size_t size, uint64_t of
 
     // If we are writing beyond current capacity, we need more RAM
     if (unlikely(offset + size > file->size)) {
-        uint8_t* new_data = (uint8_t*) kmalloc(offset + size);
-        if (unlikely(!new_data)) {
-            err_printf("ramdisk_write: Out of memory writing to file %s", name);
-            return -1;
-        }
+        size_t new_size = offset + size;
+
+        // Grow by half again as much as needed, so a run of appends reallocates
+        // a logarithmic number of times; krealloc usually manages it in place
+        if (new_size > ksize(file->data)) {
+            uint8_t* new_data = (uint8_t*) krealloc(file->data, new_size + (new_size >> 1));
+            if (unlikely(!new_data)) {
+                err_printf("ramdisk_write: Out of memory writing to file %s", name);
+                return -1;
+            }
 
-        // If there was old data, preserve it
-        if (likely(file->data)) {
-            memcpy(new_data, file->data, file->size);
-            kfree(file->data);
+            file->data = new_data;
         }
 
-        file->data = new_data;
-        file->size = offset + size;
+        file->size = new_size;
     }
 
     // Now that we're sure the buffer is big enough, copy to the offset
@@ -262,7 +261,7 @@ int ramdisk_remove(const char* name) {
 
     if (likely(file->data != NULL)) kfree(file->data);
     if (likely(file->name != NULL)) kfree((void*) file->name);
-    kfree(file);
+    fs_free_file(file);
     kfree(ramfile);
 
     return 1;
@@ -302,15 +301,13 @@ FileNode* ramdisk_getall(const char* path) {
                 if (!strchr(relative, '/')) {
                     if (strlen(relative) == 0) continue;
 
-                    FileNode* newNode = (FileNode*) kmalloc(sizeof(FileNode));
+                    FileNode* newNode = fs_alloc_node();
 
                     if (unlikely(!newNode)) {
                         err_print("ramdisk_getall: Out of memory");
                         return head;
                     }
 
-                    memset(newNode, 0, sizeof(FileNode));
-
                     newNode->file.size = ramfile->file->size;
                     newNode->file.is_directory = ramfile->file->is_directory;
                     newNode->file.name = ramfile->file->name;
@@ -26,7 +26,9 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "fs/vfs.h"
 #include "memory/heap.h"
 #include "memory/pmm.h"
+#include "memory/vma.h"
 #include "memory/vmm.h"
+#include "memory/zeropool.h"
 #include "process/task.h"
 
 #include "fs/types/elf.h"
@@ -36,6 +38,7 @@ extern uint64_t stack_top;
 
 // Defined in elf.asm
 void elf_user_trampoline_stub(uint64_t entry, uint64_t stack);
+void elf_fork_return_stub(syscalls_registers_x86_64_t* regs);
 
 /* ELF trampoline to execute the ELF, then halt after termination */
 void elf_user_trampoline() {
@@ -49,6 +52,20 @@ void elf_user_trampoline() {
     while(1) system_halt(); // Should never reach here
 }
 
+/*
+Where a forked task starts. The parent's register frame is copied onto this
+task's own kernel stack, and it drops into user mode at the same point the
+parent returns to from SYS_FORK.
+*/
+static void elf_fork_trampoline(void* args) {
+    syscalls_registers_x86_64_t regs = *(syscalls_registers_x86_64_t*) args;
+    kfree(args);
+
+    elf_fork_return_stub(&regs);
+
+    while(1) system_halt(); // Should never reach here
+}
+
 /*
 Gets the ELF file and its contents, stored into a buffer, which gets returned.
 The function also verifies if the given file is also a valid ELF file, since
@@ -105,6 +122,8 @@ static uint64_t* create_user_page_directory() {
         return NULL;
     }
 
+    pmm_set_owner(user_pd_phys, 1, PAGE_OWNER_PAGE_TABLE);
+
     uint64_t* current_pd_virt = (uint64_t*) PHYSICAL_TO_VIRTUAL(vmm_get_current_directory());
     uint64_t* user_pd_virt    = (uint64_t*) PHYSICAL_TO_VIRTUAL(user_pd_phys);
 
@@ -123,9 +142,14 @@ static uint64_t* create_user_page_directory() {
 Parses an ELF file buffer to allocate and map loadable program segments into a user
 page directory. It iterates through the program headers, aligns segment memory to
 4KB, and copies the binary's raw data into newly allocated physical frames while
-tracking the highest virtual address for future heap placement.
+tracking the highest virtual address for future heap placement. Only the pages
+holding file data are mapped here, each segment with one contiguous run of frames
+and a single vmm_map_range where the PMM has one, or page by page otherwise. The
+whole segment is added to `vmas`, so the rest of it (the BSS) is given zeroed
+frames by the page fault handler as it is touched. Returns 0 if memory ran out,
+leaving whatever was mapped for vmm_destroy_address_space.
 */
-static uint64_t map_elf_segments(uint64_t* user_pd_phys, uint8_t* file_buffer) {
+static uint64_t map_elf_segments(uint64_t* user_pd_phys, uint8_t* file_buffer, Vma** vmas) {
     elf_header_t* header = (elf_header_t*) file_buffer;
     elf_program_header_t* phdr = (elf_program_header_t*)(file_buffer + header->e_phoff);
     uint64_t highest_vaddr = 0;
@@ -137,17 +161,51 @@ static uint64_t map_elf_segments(uint64_t* user_pd_phys, uint8_t* file_buffer) {
 
         uint64_t start_vaddr = phdr[i].p_vaddr & ~0xFFFULL;
         uint64_t end_vaddr   = (phdr[i].p_vaddr + phdr[i].p_memsz + 0xFFFULL) & ~0xFFFULL;
+        uint64_t data_vaddr  = (phdr[i].p_filesz > 0) ? (phdr[i].p_vaddr + phdr[i].p_filesz + 0xFFFULL) & ~0xFFFULL : start_vaddr;
 
         if (end_vaddr > highest_vaddr) {
             highest_vaddr = end_vaddr;
         }
 
-        for (uint64_t v = start_vaddr; v < end_vaddr; v += PAGE_SIZE) {
-            void* phys = pmm_alloc_page();
-            vmm_map_page(user_pd_phys, phys, (void*) v, PAGE_PRESENT | PAGE_RW | PAGE_USER | PAGE_CACHE);
+        vma_add(vmas, start_vaddr, end_vaddr, VMA_WRITE);
+
+        // A contiguous run lets the file backed part be zeroed, copied and mapped at once
+        uint64_t pages = (data_vaddr - start_vaddr) / PAGE_SIZE;
+        if (pages == 0) continue;
+
+        void* run = pmm_alloc_pages(pages);
+
+        if (likely(run != NULL)) {
+            uint8_t* kernel_vaddr = (uint8_t*) PHYSICAL_TO_VIRTUAL(run);
+
+            memset(kernel_vaddr, 0, pages * PAGE_SIZE);
+            memcpy(kernel_vaddr + (phdr[i].p_vaddr - start_vaddr),
+                   file_buffer + phdr[i].p_offset,
+                   phdr[i].p_filesz);
+
+            pmm_set_owner(run, pages, PAGE_OWNER_USER);
+
+            if (likely(vmm_map_range(user_pd_phys, run, (void*) start_vaddr, pages, PAGE_PRESENT | PAGE_RW | PAGE_USER | PAGE_CACHE))) continue;
+
+            // A page table ran out, so none of the run can stay mapped
+            vmm_unmap_range(user_pd_phys, (void*) start_vaddr, pages, false);
+            pmm_free_pages(run, pages);
+            goto fail;
+        }
+
+        for (uint64_t v = start_vaddr; v < data_vaddr; v += PAGE_SIZE) {
+            // Zeroed up front, so only the file backed part needs writing
+            void* phys = pmm_alloc_zeroed_page();
+            if (unlikely(phys == NULL)) goto fail;
+
+            pmm_set_owner(phys, 1, PAGE_OWNER_USER);
+
+            if (unlikely(!vmm_map_page(user_pd_phys, phys, (void*) v, PAGE_PRESENT | PAGE_RW | PAGE_USER | PAGE_CACHE))) {
+                pmm_free_page(phys);
+                goto fail;
+            }
 
             uint8_t* kernel_vaddr = (uint8_t*) PHYSICAL_TO_VIRTUAL(phys);
-            memset(kernel_vaddr, 0, PAGE_SIZE);
 
             uint64_t segment_start    = phdr[i].p_vaddr;
             uint64_t segment_data_end = phdr[i].p_vaddr + phdr[i].p_filesz;
@@ -170,6 +228,34 @@ static uint64_t map_elf_segments(uint64_t* user_pd_phys, uint8_t* file_buffer) {
     system_int_on();
 
     return highest_vaddr;
+
+fail:
+    system_int_on();
+
+    err_print("map_elf_segments: out of memory");
+    return 0;
+}
+
+/*
+Maps the top page of the user stack into `user_pd_phys`, and adds the stack to
+`vmas`, so that it grows down by the page fault handler as it is used. Returns
+false if memory ran out.
+*/
+static bool map_user_stack(uint64_t* user_pd_phys, Vma** vmas) {
+    uint64_t stack_virt_addr = USER_STACK_TOP - PAGE_SIZE;
+
+    void* stack_phys = pmm_alloc_zeroed_page();
+    if (unlikely(!stack_phys)) return false;
+
+    pmm_set_owner(stack_phys, 1, PAGE_OWNER_USER);
+
+    if (unlikely(!vmm_map_page(user_pd_phys, stack_phys, (void*) stack_virt_addr, PAGE_PRESENT | PAGE_RW | PAGE_USER | PAGE_CACHE))) {
+        pmm_free_page(stack_phys);
+        return false;
+    }
+
+    vma_add(vmas, stack_virt_addr, USER_STACK_TOP, VMA_WRITE | VMA_STACK);
+    return true;
 }
 
 /*
@@ -191,20 +277,23 @@ task* exec_elf(const char* path) {
         return NULL;
     }
 
-    uint64_t highest_vaddr = map_elf_segments(user_pd_phys, file_buffer);
+    Vma* vmas = NULL;
+    uint64_t highest_vaddr = map_elf_segments(user_pd_phys, file_buffer, &vmas);
     elf_header_t* header = (elf_header_t*) file_buffer;
 
+    if (unlikely(highest_vaddr == 0 || !map_user_stack(user_pd_phys, &vmas))) {
+        err_printf("exec_elf: Out of memory mapping ELF file %s", path);
+        vma_free_all(&vmas);
+        vmm_destroy_address_space(user_pd_phys);
+        kfree(file_buffer);
+        return NULL;
+    }
+
     task* elf_task = create_task((void(*)(void*)) header->e_entry, path, PRIV_USER, NULL);
     elf_task->page_directory = user_pd_phys;
     elf_task->heap_break     = highest_vaddr;
     elf_task->stack_origin   = (uint64_t*) USER_STACK_TOP;
-
-    void* stack_phys = pmm_alloc_page();
-    uint64_t stack_virt_addr = USER_STACK_TOP - PAGE_SIZE;
-    vmm_map_page(user_pd_phys, stack_phys, (void*) stack_virt_addr, PAGE_PRESENT | PAGE_RW | PAGE_USER | PAGE_CACHE);
-
-    uint64_t* stack_ptr = (uint64_t*) PHYSICAL_TO_VIRTUAL(stack_phys);
-    memset(stack_ptr, 0, PAGE_SIZE);
+    elf_task->vmas           = vmas;
 
     kfree(file_buffer);
     return elf_task;
@@ -214,7 +303,7 @@ task* exec_elf(const char* path) {
 Replaces the execution context of an existing task with a new ELF file. It maps
 the new ELF into a fresh page directory and stack, overwrites the provided task's
 memory structures and entry point in-place, and immediately switches to the new
-memory space.
+memory space. The old one is torn down, unless it was the kernel's.
 */
 bool exec_elf_inplace(const char* path, task* t) {
     uint8_t* file_buffer = load_elf_file(path, NULL);
@@ -228,20 +317,67 @@ bool exec_elf_inplace(const char* path, task* t) {
         return false;
     }
 
-    uint64_t highest_vaddr = map_elf_segments(user_pd_phys, file_buffer);
+    Vma* vmas = NULL;
+    uint64_t highest_vaddr = map_elf_segments(user_pd_phys, file_buffer, &vmas);
     elf_header_t* header = (elf_header_t*) file_buffer;
 
-    void* stack_phys = pmm_alloc_page();
-    uint64_t stack_virt_addr = USER_STACK_TOP - PAGE_SIZE;
-    vmm_map_page(user_pd_phys, stack_phys, (void*) stack_virt_addr, PAGE_PRESENT | PAGE_RW | PAGE_USER | PAGE_CACHE);
-    memset(PHYSICAL_TO_VIRTUAL(stack_phys), 0, PAGE_SIZE);
+    if (unlikely(highest_vaddr == 0 || !map_user_stack(user_pd_phys, &vmas))) {
+        vma_free_all(&vmas);
+        vmm_destroy_address_space(user_pd_phys);
+        kfree(file_buffer);
+        return false;
+    }
 
+    vma_free_all(&t->vmas);
+
+    uint64_t* old_pd_phys = t->page_directory;
+
+    t->vmas           = vmas;
     t->page_directory = user_pd_phys;
     t->heap_break     = highest_vaddr;
     t->entry_func     = (void(*)(void*)) header->e_entry;
 
     vmm_switch_directory(t->page_directory);
+    vmm_destroy_address_space(old_pd_phys);
 
     kfree(file_buffer);
     return true;
 }
+
+/*
+Duplicates the user task `parent` for SYS_FORK, called with the register frame
+`regs` of that syscall. The child gets a copy-on-write clone of the parent's
+address space, so only page tables are copied, and frames are only copied once
+either side writes to them. It also gets its own copy of the VMAs, and resumes
+in user mode from the same syscall, seeing 0 in RAX. Returns the child, or NULL
+if memory ran out.
+*/
+task* fork_elf(task* parent, const syscalls_registers_x86_64_t* regs) {
+    syscalls_registers_x86_64_t* child_regs = (syscalls_registers_x86_64_t*) kmalloc(sizeof(syscalls_registers_x86_64_t));
+    if (unlikely(!child_regs)) return NULL;
+
+    Vma* vmas = NULL;
+    if (unlikely(!vma_copy_all(&vmas, parent->vmas))) {
+        kfree(child_regs);
+        return NULL;
+    }
+
+    uint64_t* child_pd_phys = vmm_clone_address_space(parent->page_directory);
+    if (unlikely(!child_pd_phys)) {
+        vma_free_all(&vmas);
+        kfree(child_regs);
+        return NULL;
+    }
+
+    *child_regs = *regs;
+    child_regs->rax = 0;
+
+    // Created as a kernel task so it starts in elf_fork_trampoline, and only then runs as the parent did
+    task* child = create_task(elf_fork_trampoline, parent->name, PRIV_KERNEL, child_regs);
+    child->privilege      = parent->privilege;
+    child->page_directory = child_pd_phys;
+    child->heap_break     = parent->heap_break;
+    child->vmas           = vmas;
+
+    return child;
+}
@@ -21,18 +21,56 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <stddef.h>
 #include <stdint.h>
 
+#include "klib/string.h"
+
 #include "drivers/terminal.h"
+#include "memory/slab.h"
 
 #include "fs/ramdisk.h"
 #include "fs/vfs.h"
 
 VFS* current_vfs = NULL;
 
+// Every directory listing allocates a node per entry, so File and FileNode
+// get caches of their own rather than churning the general heap
+static KmemCache* file_cache = NULL;
+static KmemCache* node_cache = NULL;
+
+/* Create the object caches for File and FileNode */
+void init_vfs() {
+    file_cache = kmem_cache_create("File", sizeof(File), 32, NULL);
+    node_cache = kmem_cache_create("FileNode", sizeof(FileNode), KMEM_CACHE_LINE, NULL);
+}
+
 /* Change the current VFS */
 void vfs_mount(VFS* ops) {
     current_vfs = ops;
 }
 
+/* Allocate a zeroed File. Free it with fs_free_file. */
+File* fs_alloc_file() {
+    File* file = (File*) kmem_cache_alloc(file_cache);
+    if (likely(file)) memset(file, 0, sizeof(File));
+    return file;
+}
+
+/* Give a File from fs_alloc_file back. Does not free its name or data. */
+void fs_free_file(File* file) {
+    kmem_cache_free(file_cache, file);
+}
+
+/* Allocate a zeroed FileNode. Free it with fs_free_node. */
+FileNode* fs_alloc_node() {
+    FileNode* node = (FileNode*) kmem_cache_alloc(node_cache);
+    if (likely(node)) memset(node, 0, sizeof(FileNode));
+    return node;
+}
+
+/* Give a FileNode from fs_alloc_node (or fs_getall) back */
+void fs_free_node(FileNode* node) {
+    kmem_cache_free(node_cache, node);
+}
+
 /* Read file at absolute name into buffer from offset to offset+size */
 int fs_read(const char* name, void* buffer, size_t size, uint64_t offset) {
     if (unlikely(!current_vfs || !current_vfs->read)) {
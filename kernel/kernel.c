@@ -37,6 +37,8 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "fs/types/elf.h"
 #include "fs/vfs.h"
 #include "memory/heap.h"
+#include "memory/pmm.h"
+#include "memory/zeropool.h"
 #include "process/task.h"
 #include "shell/shell.h"
 #include "syshw/battery.h"
@@ -85,6 +87,7 @@ unique for each processor architecture. The initialisation sequence is as follow
 - init_terminal
 
 - ACPI
+- init_pmm_numa: Splits physical memory into NUMA nodes by the SRAT, now that ACPI is up
 
 - init_irq_controller
 
@@ -96,12 +99,13 @@ unique for each processor architecture. The initialisation sequence is as follow
 
 - init_storage
 - system_int_on: Turn on system interrupts
-- File systems: init_ramdisk, init_fat32
+- File systems: init_vfs, init_ramdisk, init_fat32
 
 - init_battery
 
 Once the sequence is complete, terminal's mouse handler is created as a separate
-task, after which, the shell is created. The shell is just an interactive environment
+task, after which, the shell is created, followed by the task that keeps a pool of
+zeroed pages ready for the PMM, and the one that frees tasks that killed themselves. The shell is just an interactive environment
 so that the user can do something (graphics doesn't exist yet). If `BOOT_INTO_KSHELL`
 is defined to a truthy value, it would boot into the built-in kernel shell, else, it
 would boot into the `shelf.elf` file. If the shelf executable is absent, it would run
@@ -128,6 +132,7 @@ void kmain() {
 
     system_int_on();
 
+    init_vfs();
     init_ramdisk();
     init_fat32();
 
@@ -144,6 +149,8 @@ void kmain() {
     AcpiEnableSubsystem(ACPI_FULL_INITIALIZATION);
     AcpiInitializeObjects(ACPI_FULL_INITIALIZATION);
 
+    init_pmm_numa();
+
     init_irq_controller();
 
     init_multitasking();
@@ -156,6 +163,8 @@ void kmain() {
 
     create_task((void(*)(void*)) handle_mouse, "Terminal mouse handler", PRIV_KERNEL, NULL);
     create_task((void(*)(void*)) shell_thread, "Shell", PRIV_KERNEL, NULL);
+    create_task((void(*)(void*)) zero_pool_thread, "Page zeroing", PRIV_KERNEL, NULL);
+    create_task((void(*)(void*)) task_reaper_thread, "Task reaper", PRIV_KERNEL, NULL);
 
     // init_multicore();
 
@@ -30,6 +30,10 @@ int fx_dirscan(char* path, FileData* buffer, size_t count) {
     return farix_syscall(SYS_DIRSCAN, (uint64_t) path, (uint64_t) buffer, (uint64_t) count, 0, 0);
 }
 
+int fx_fork() {
+    return farix_syscall(SYS_FORK, 0, 0, 0, 0, 0);
+}
+
 // Super User functions
 
 int UART_PUTS(const char* data) {
@@ -79,3 +83,11 @@ int GET_TASK_LIST(int list_id, TaskListData* buffer) {
 int TASK_KILL(int pid) {
     return farix_syscall(SYS_TASK_KILL, (uint64_t) pid, 0, 0, 0, 0);
 }
+
+int HEAP_PROFILE(HeapProfData* buffer, int max_count) {
+    return farix_syscall(SYS_HEAP_PROFILE, (uint64_t) buffer, (uint64_t) max_count, 0, 0, 0);
+}
+
+int GET_HEAP_STATS(HeapStatsData* buffer) {
+    return farix_syscall(SYS_GET_HEAP_STATS, (uint64_t) buffer, 0, 0, 0, 0);
+}
@@ -22,33 +22,257 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <stddef.h>
 #include <stdint.h>
 
+#include "klib/string.h"
+
 #include "hal.h"
 
 #include "cpu/multicore.h"
 #include "drivers/terminal.h"
 #include "memory/pmm.h"
+#include "memory/vmalloc.h"
 #include "memory/vmm.h"
 
 #include "memory/heap.h"
+#include "memory/heapprof.h"
 
 #define HEAP_INIT_SIZE_KB 512
 
-void* heap_start = (void*) PHYSICAL_TO_VIRTUAL(0x1000000);
+#define HEAP_EXPAND_MIN_KB 64   // Smallest step kheap_expand grows the heap by
+#define HEAP_EXPAND_MAX_KB 4096 // Largest geometric step, bigger requests still get what they need
+#define HEAP_TRIM_AT_KB    256  // Smallest free tail worth giving back to the PMM
+#define HEAP_TRIM_KEEP_KB  64   // Free tail left behind by a trim, so the next burst need not expand
+
+#define HEAP_LARGE_ORDER 9 // PMM order of a 2 MB frame block, for a large page of heap
+
+#define HEAP_MIN_PAYLOAD      16
+#define HEAP_CLASS_SCAN_LIMIT 8
+
+#define HEAP_MAG_CLASSES 8  // Requests up to 2 KB go through the magazines
+#define HEAP_MAG_SIZE    16 // Blocks held per class, per core
+#define HEAP_MAG_BATCH   8  // Blocks moved between a magazine and the heap at once
+
+// A free segment's list links live in its own (unused) payload, so the header
+// does not grow. The smallest payload a split can leave behind is 16 bytes,
+// which is exactly enough for the two pointers.
+#define FREE_LINKS(seg) ((HeapFreeLinks*)((uint64_t)(seg) + sizeof(HeapSegment)))
+
+typedef struct {
+    HeapSegment* next;
+    HeapSegment* prev;
+} HeapFreeLinks;
+
+// Per-core cache of recently freed small blocks, plus that core's share of the
+// allocation counters. It is only ever touched by its own core with interrupts
+// off, so the common kmalloc/kfree pair needs no lock.
+typedef struct {
+    void*    objects[HEAP_MAG_CLASSES][HEAP_MAG_SIZE];
+    uint8_t  count[HEAP_MAG_CLASSES];
+    size_t   cached_bytes; // Payload bytes of the blocks in `objects`, counted as used by the heap
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t class_allocs[HEAP_CLASS_COUNT];
+} __attribute__((aligned(64))) HeapMagazine;
+
+void* heap_start = (void*) HEAP_START;
 void* heap_end   = NULL;
 HeapSegment* first_segment = NULL;
 
-static spinlock heap_lock = 0;
+static HeapSegment* last_segment = NULL; // Always the segment ending at heap_end
+
+// Running totals, kept up to date under heap_lock but read without it
+static size_t heap_used_bytes    = 0; // Payload bytes of segments not on a free list
+static size_t heap_segment_count = 0;
+
+static HeapSegment* free_lists[HEAP_CLASS_COUNT];
+static uint32_t     free_lists_mask = 0; // Bit n is set while free_lists[n] is non-empty
+
+static HeapMagazine heap_magazines[MAX_CORES];
+
+static spinlock heap_lock   = 0;
+static spinlock expand_lock = 0; // Serialises moving heap_end, taken before heap_lock
+
+/*
+Size class of a payload size: floor(log2(size)) - 4, so class 0 holds [16, 32),
+class 1 holds [32, 64), and so on. Everything past the last class is lumped
+into it.
+*/
+static inline uint32_t heap_size_class(size_t size) {
+    uint32_t class = (63 - __builtin_clzll(size | HEAP_MIN_PAYLOAD)) - 4;
+    return (class < HEAP_CLASS_COUNT) ? class : HEAP_CLASS_COUNT - 1;
+}
+
+/* Push a free segment onto the head of its size class list */
+static inline void free_list_insert(HeapSegment* seg) {
+    uint32_t class = heap_size_class(seg->size);
+    HeapFreeLinks* links = FREE_LINKS(seg);
+
+    links->prev = NULL;
+    links->next = free_lists[class];
+    if (links->next) FREE_LINKS(links->next)->prev = seg;
+
+    free_lists[class] = seg;
+    free_lists_mask |= (1U << class);
+}
+
+/* Unlink a free segment from its size class list */
+static inline void free_list_remove(HeapSegment* seg) {
+    uint32_t class = heap_size_class(seg->size);
+    HeapFreeLinks* links = FREE_LINKS(seg);
+
+    if (links->prev) FREE_LINKS(links->prev)->next = links->next;
+    else             free_lists[class] = links->next;
+
+    if (links->next) FREE_LINKS(links->next)->prev = links->prev;
+
+    if (free_lists[class] == NULL) free_lists_mask &= ~(1U << class);
+}
+
+/*
+Find a free segment of at least `size` bytes. The segment's own class is
+scanned first-fit for a handful of entries, since a block there may or may not
+be big enough. Failing that, the head of the next non-empty larger class is
+guaranteed to fit, and the mask gets us there with a single ctz.
+*/
+static HeapSegment* free_list_find(size_t size) {
+    uint32_t class = heap_size_class(size);
+
+    HeapSegment* current = free_lists[class];
+    for (int i = 0; current != NULL && i < HEAP_CLASS_SCAN_LIMIT; i++) {
+        if (current->size >= size) return current;
+        current = FREE_LINKS(current)->next;
+    }
+
+    uint32_t larger = free_lists_mask & ~((2U << class) - 1);
+    if (likely(larger)) return free_lists[__builtin_ctz(larger)];
+
+    // The last class is open ended, so a fit may be further down its list
+    if (unlikely(class == HEAP_CLASS_COUNT - 1)) {
+        while (current != NULL) {
+            if (current->size >= size) return current;
+            current = FREE_LINKS(current)->next;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+Carve `size` bytes out of the given free segment, giving the remainder back to
+the free lists if it is big enough to hold a segment of its own.
+*/
+static void* heap_take(HeapSegment* current, size_t size, uint64_t caller) {
+    free_list_remove(current);
+
+    // We need enough space for the requested size + a new header + at least 16 bytes of data
+    if (current->size > size + sizeof(HeapSegment) + HEAP_MIN_PAYLOAD) {
+        size_t total_offset = sizeof(HeapSegment) + size;
+        total_offset = (total_offset + 15) & ~(size_t) 15;
+        HeapSegment* next_seg = (HeapSegment*) ((uint64_t) current + total_offset);
+
+        next_seg->size    = current->size - total_offset;
+        next_seg->is_free = true;
+        next_seg->next    = current->next;
+        next_seg->prev    = current;
+        next_seg->magic   = HEAP_MAGIC;
+        next_seg->caller  = 0;
+        next_seg->in_magazine = false;
+        next_seg->prof_epoch  = 0;
+
+        if (current->next != NULL) {
+            current->next->prev = next_seg;
+        } else {
+            last_segment = next_seg;
+        }
+
+        current->next = next_seg;
+        current->size = total_offset - sizeof(HeapSegment);
+
+        free_list_insert(next_seg);
+        heap_segment_count++;
+    }
+
+    heap_used_bytes += current->size;
+
+    current->is_free = false;
+    current->caller  = (uint32_t) caller;
+    current->in_magazine = false;
+    current->prof_epoch  = 0;
+
+    return (void*)((uint64_t) current + sizeof(HeapSegment));
+}
+
+/*
+Back `pages` pages at `virt` with physical frames. Wherever the range covers a
+whole 2 MB stretch, it gets a 2 MB block of frames and a single large page.
+The rest is mapped a contiguous run at a time with vmm_map_range, or page by
+page if the PMM cannot find one. Returns false if memory ran out, with every
+page it had mapped unmapped and freed again.
+*/
+static bool heap_map_pages(void* virt, uint64_t pages) {
+    uint64_t* pd = (uint64_t*) VIRTUAL_TO_PHYSICAL(kernel_directory);
+    uint64_t  v  = (uint64_t) virt;
+
+    while (pages > 0) {
+        if ((v & (PAGE_SIZE_2M - 1)) == 0 && pages >= PAGE_SIZE_2M / PAGE_SIZE) {
+            void* block = pmm_alloc_order(HEAP_LARGE_ORDER);
+
+            if (likely(block != NULL) && vmm_map_large(pd, block, (void*) v, PAGE_SIZE_2M, PAGE_PRESENT | PAGE_RW | PAGE_CACHE)) {
+                pmm_set_owner(block, PAGE_SIZE_2M / PAGE_SIZE, PAGE_OWNER_HEAP);
+
+                v     += PAGE_SIZE_2M;
+                pages -= PAGE_SIZE_2M / PAGE_SIZE;
+                continue;
+            }
+
+            if (block != NULL) pmm_free_order(block, HEAP_LARGE_ORDER);
+        }
+
+        // Up to the next 2 MB boundary, or the end of the range
+        uint64_t run = (PAGE_SIZE_2M - (v & (PAGE_SIZE_2M - 1))) / PAGE_SIZE;
+        if (run > pages) run = pages;
+
+        void* phys = pmm_alloc_pages(run);
+        if (likely(phys != NULL)) {
+            pmm_set_owner(phys, run, PAGE_OWNER_HEAP);
+
+            if (unlikely(!vmm_map_range(pd, phys, (void*) v, run, PAGE_PRESENT | PAGE_RW | PAGE_CACHE))) {
+                vmm_unmap_range(pd, (void*) v, run, false);
+                pmm_free_pages(phys, run);
+                goto fail;
+            }
+        } else {
+            for (uint64_t i = 0; i < run; i++) {
+                phys = pmm_alloc_page();
+                if (unlikely(phys == NULL)) goto fail;
+
+                pmm_set_owner(phys, 1, PAGE_OWNER_HEAP);
+
+                if (unlikely(!vmm_map_page(pd, phys, (void*)(v + (i * PAGE_SIZE)), PAGE_PRESENT | PAGE_RW | PAGE_CACHE))) {
+                    pmm_free_page(phys);
+                    goto fail;
+                }
+            }
+        }
+
+        v     += run * PAGE_SIZE;
+        pages -= run;
+    }
+
+    return true;
+
+fail:
+    // Whatever was mapped up to here holds frames of its own; the page tables stay
+    vmm_unmap_range(pd, virt, (v + pages * PAGE_SIZE - (uint64_t) virt) / PAGE_SIZE, true);
+    return false;
+}
 
 /* Initialises heap by carving out the required memory */
 void init_heap() {
     uint64_t initial_pages = (HEAP_INIT_SIZE_KB * 1024) / PAGE_SIZE;
 
-    for (uint64_t i = 0; i < initial_pages; i++) {
-        void* phys = pmm_alloc_page();
-        vmm_map_page((uint64_t*) VIRTUAL_TO_PHYSICAL(kernel_directory),
-            phys, (void*)((uint64_t) heap_start + (i * PAGE_SIZE)),
-            PAGE_PRESENT | PAGE_RW | PAGE_CACHE);
-    }
+    heap_map_pages(heap_start, initial_pages);
 
     heap_end = (void*)((uint64_t) heap_start + (initial_pages * PAGE_SIZE));
 
@@ -59,166 +283,634 @@ void init_heap() {
     first_segment->is_free = true;
     first_segment->magic   = HEAP_MAGIC;
     first_segment->caller  = 0;
+    first_segment->in_magazine = false;
+    first_segment->prof_epoch  = 0;
+
+    last_segment = first_segment;
+    heap_segment_count = 1;
+
+    free_list_insert(first_segment);
 }
 
-/* Kernel malloc */
-void* kmalloc(size_t size) {
-    if (unlikely(size == 0)) return NULL;
+/*
+Give a segment back to the free lists, merging it with its free neighbours.
+The heap lock must be held.
+*/
+static void heap_release(HeapSegment* current) {
+    heap_used_bytes -= current->size;
+
+    current->is_free = true;
+    current->caller  = 0;
+
+    // Merge Right
+    HeapSegment* right = current->next;
+    if (right && right->is_free && right->magic == HEAP_MAGIC) {
+        free_list_remove(right);
+
+        current->size += right->size + sizeof(HeapSegment);
+        current->next = right->next;
+        if (current->next) current->next->prev = current;
+        else               last_segment = current;
+
+        right->magic = 0;
+        heap_segment_count--;
+    }
+
+    // Merge Left
+    HeapSegment* left = current->prev;
+    if (left && left->is_free && left->magic == HEAP_MAGIC) {
+        free_list_remove(left);
+
+        left->size += current->size + sizeof(HeapSegment);
+        left->next = current->next;
+        if (current->next) current->next->prev = left;
+        else               last_segment = left;
+
+        current->magic  = 0;
+        current->caller = 0;
+        heap_segment_count--;
+
+        current = left;
+    }
+
+    free_list_insert(current);
+}
+
+/*
+Whether enough of the heap sits unused at its end to be worth trimming: the free
+tail must be at least HEAP_TRIM_AT_KB and more than half the heap, so the room
+a geometric expansion just added is not handed straight back. The heap lock
+must be held.
+*/
+static inline bool heap_should_trim() {
+    size_t heap_size = (uint64_t) heap_end - (uint64_t) heap_start;
+
+    return last_segment->is_free
+        && last_segment->size >= HEAP_TRIM_AT_KB * 1024
+        && last_segment->size > heap_size / 2
+        && heap_size > HEAP_INIT_SIZE_KB * 1024;
+}
+
+/*
+Allocate straight from the free lists, expanding the heap until it fits.
+Returns NULL if the heap cannot grow any more.
+*/
+static void* heap_alloc(size_t size, uint64_t caller) {
+    while (1) {
+        uint64_t flags = spin_lock_irqsave(&heap_lock);
+
+        HeapSegment* current = free_list_find(size);
+        if (likely(current != NULL)) {
+            void* ptr = heap_take(current, size, caller);
+            spin_unlock_irqrestore(&heap_lock, flags);
+            return ptr;
+        }
+
+        spin_unlock_irqrestore(&heap_lock, flags);
+
+        // Reaching here means we are out of memory
+        if (unlikely(!kheap_expand(size))) return NULL;
+    }
+}
+
+/*
+Refill an empty magazine with a batch of blocks, all carved out under a single
+acquisition of the heap lock. Every block is exactly the class size, so any of
+them can serve any request of that class. Returns the number of blocks added.
+*/
+static uint32_t magazine_refill(HeapMagazine* mag, uint32_t class) {
+    size_t class_size = (size_t) HEAP_MIN_PAYLOAD << class;
+    uint32_t count = 0;
+
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+
+    while (count < HEAP_MAG_BATCH) {
+        HeapSegment* seg = free_list_find(class_size);
+        if (unlikely(seg == NULL)) break;
+
+        void* ptr = heap_take(seg, class_size, 0);
+        HeapSegment* block = (HeapSegment*)((uint64_t) ptr - sizeof(HeapSegment));
+
+        block->in_magazine = true;
+        mag->objects[class][count++] = ptr;
+        mag->cached_bytes += block->size;
+    }
+
+    spin_unlock_irqrestore(&heap_lock, flags);
+
+    mag->count[class] = count;
+    return count;
+}
+
+/*
+Drain the oldest half of a full magazine back into the heap under a single
+acquisition of the heap lock, and slide the remaining blocks down. Returns
+whether the heap should now be trimmed.
+*/
+static bool magazine_drain(HeapMagazine* mag, uint32_t class) {
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+
+    for (uint32_t i = 0; i < HEAP_MAG_BATCH; i++) {
+        HeapSegment* seg = (HeapSegment*)((uint64_t) mag->objects[class][i] - sizeof(HeapSegment));
+
+        mag->cached_bytes -= seg->size;
+        seg->in_magazine = false;
+        heap_release(seg);
+    }
+
+    bool trim = heap_should_trim();
+
+    spin_unlock_irqrestore(&heap_lock, flags);
+
+    for (uint32_t i = HEAP_MAG_BATCH; i < HEAP_MAG_SIZE; i++) {
+        mag->objects[class][i - HEAP_MAG_BATCH] = mag->objects[class][i];
+    }
+
+    mag->count[class] = HEAP_MAG_SIZE - HEAP_MAG_BATCH;
+
+    return trim;
+}
+
+/*
+Count an allocation of the given size class, or a free, on this core's share of
+the counters, for the paths that do not already hold the magazine.
+*/
+static inline void heap_count(bool alloc, uint32_t class) {
+    uint64_t flags = save_disable_interrupts();
+    HeapMagazine* mag = &heap_magazines[get_core_id()];
+
+    if (alloc) {
+        mag->allocs++;
+        mag->class_allocs[class]++;
+    } else {
+        mag->frees++;
+    }
+
+    restore_interrupts(flags);
+}
 
+/*
+Hand an allocated block to its caller: record the call site in its header and,
+while the profiler is running, stamp it and account it to that site.
+*/
+static inline void* heap_track(void* ptr, uint64_t caller) {
+    HeapSegment* seg = (HeapSegment*)((uint64_t) ptr - sizeof(HeapSegment));
+
+    seg->caller = (uint32_t) caller;
+
+    if (unlikely(heap_prof_enabled)) {
+        seg->prof_epoch = heap_prof_epoch;
+        heap_prof_alloc(seg->caller, seg->size);
+    } else {
+        seg->prof_epoch = 0;
+    }
+
+    return ptr;
+}
+
+/* kmalloc on behalf of the given call site */
+static void* heap_kmalloc(size_t size, uint64_t caller) {
     // Align size to 16 bytes
     size = (size + 15) & ~(size_t) 15;
 
-    spin_lock(&heap_lock);
+    // Small requests are served by the magazine of the class they round up to,
+    // so a block from it is always big enough.
+    uint32_t class = heap_size_class(size);
+    if (size > ((size_t) HEAP_MIN_PAYLOAD << class) && class < HEAP_CLASS_COUNT - 1) class++;
 
-    HeapSegment* current = first_segment;
+    // Page sized and larger buffers get their own pages, and give them back on free
+    if (unlikely(size >= PAGE_SIZE)) {
+        heap_count(true, class);
 
-    while (current != NULL) {
-        if (current->is_free && current->size >= size) {
-            // We need enough space for the requested size + a new header + at least 16 bytes of data
-            if (current->size > size + sizeof(HeapSegment) + 16) {
-                size_t total_offset = sizeof(HeapSegment) + size;
-                total_offset = (total_offset + 15) & ~(size_t) 15;
-                HeapSegment* next_seg = (HeapSegment*) ((uint64_t) current + total_offset);
+        void* ptr = vmalloc(size);
 
-                next_seg->size = current->size - total_offset;
-                next_seg->is_free = true;
-                next_seg->next    = current->next;
-                next_seg->prev    = current;
-                next_seg->magic   = HEAP_MAGIC;
-                next_seg->caller  = 0;
+        if (unlikely(heap_prof_enabled && ptr != NULL)) {
+            heap_prof_alloc_large(ptr, (uint32_t) caller, (size + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1));
+        }
 
-                if (current->next != NULL) {
-                    current->next->prev = next_seg;
-                }
+        return ptr;
+    }
+
+    if (likely(class < HEAP_MAG_CLASSES)) {
+        uint64_t flags = save_disable_interrupts();
+        HeapMagazine* mag = &heap_magazines[get_core_id()];
+
+        mag->allocs++;
+        mag->class_allocs[class]++;
 
-                current->next = next_seg;
-                current->size = total_offset - sizeof(HeapSegment);
+        void* ptr = NULL;
+
+        if (likely(mag->count[class] != 0)) {
+            mag->hits++;
+            ptr = mag->objects[class][--mag->count[class]];
+        } else {
+            mag->misses++;
+            if (likely(magazine_refill(mag, class) != 0)) {
+                ptr = mag->objects[class][--mag->count[class]];
             }
+        }
 
-            current->is_free = false;
-            current->caller  = (uint64_t) __builtin_return_address(0);
+        if (likely(ptr != NULL)) {
+            HeapSegment* block = (HeapSegment*)((uint64_t) ptr - sizeof(HeapSegment));
 
-            spin_unlock(&heap_lock);
-            return (void*)((uint64_t) current + sizeof(HeapSegment));
+            block->in_magazine = false;
+            mag->cached_bytes -= block->size;
         }
 
-        current = current->next;
+        restore_interrupts(flags);
+
+        if (likely(ptr != NULL)) return heap_track(ptr, caller);
+
+        // The heap itself is out of blocks, let the slow path expand it
+        size = (size_t) HEAP_MIN_PAYLOAD << class;
+    } else {
+        heap_count(true, class);
     }
 
-    spin_unlock(&heap_lock);
+    void* ptr = heap_alloc(size, caller);
+    if (unlikely(ptr == NULL)) return NULL;
 
-    // Reaching here means we are out of memory
-    kheap_expand(size);
-    return kmalloc(size);
+    return heap_track(ptr, caller);
+}
+
+/* Kernel malloc */
+void* kmalloc(size_t size) {
+    if (unlikely(size == 0)) return NULL;
+
+    return heap_kmalloc(size, (uint64_t) __builtin_return_address(0));
 }
 
 /* Free memory malloc-ed by kernel */
 void kfree(void* ptr) {
     if (unlikely(ptr == NULL)) return;
 
-    spin_lock(&heap_lock);
+    // vmalloc allocations have no header in front of them
+    if (unlikely(IS_VMALLOC(ptr))) {
+        heap_count(false, 0);
+        heap_prof_free_large(ptr);
+        vfree(ptr);
+        return;
+    }
 
     HeapSegment* current = (HeapSegment*)((uint64_t) ptr - sizeof(HeapSegment));
 
-    // Verify magic field within lock protection before reading/writing nodes
+    // The segment still belongs to the caller, so it is safe to check before locking
     if (unlikely(current->magic != HEAP_MAGIC)) {
         err_printf("kfree: invalid magic field at %p\n", ptr);
-        spin_unlock(&heap_lock);
         return;
     }
 
-    current->is_free = true;
-    current->caller  = 0;
+    // A second free would put the segment on a free list, or in a magazine, twice
+    if (unlikely(current->is_free || current->in_magazine)) {
+        err_printf("kfree: double free at %p\n", ptr);
+        return;
+    }
 
-    // Merge Right
-    if (current->next && current->next->is_free && current->next->magic == HEAP_MAGIC) {
-        current->size += current->next->size + sizeof(HeapSegment);
-        current->next = current->next->next;
-        if (current->next) current->next->prev = current;
+    // Allocations from an earlier profiler epoch were already forgotten by a reset
+    if (unlikely(current->prof_epoch != 0)) {
+        if (current->prof_epoch == heap_prof_epoch) heap_prof_free(current->caller, current->size);
+        current->prof_epoch = 0;
     }
 
-    // Merge Left
-    if (current->prev && current->prev->is_free && current->prev->magic == HEAP_MAGIC) {
-        HeapSegment* prev = current->prev;
-        prev->size += current->size + sizeof(HeapSegment);
-        prev->next = current->next;
-        if (current->next) current->next->prev = prev;
+    // Any block at least as big as its class fits every request of that class
+    uint32_t class = heap_size_class(current->size);
 
-        current->magic  = 0;
-        current->caller = 0;
+    if (likely(class < HEAP_MAG_CLASSES)) {
+        uint64_t flags = save_disable_interrupts();
+        HeapMagazine* mag = &heap_magazines[get_core_id()];
+        bool trim = false;
+
+        mag->frees++;
+
+        if (unlikely(mag->count[class] == HEAP_MAG_SIZE)) {
+            trim = magazine_drain(mag, class);
+        }
+
+        current->caller      = 0;
+        current->in_magazine = true;
+        mag->objects[class][mag->count[class]++] = ptr;
+        mag->cached_bytes += current->size;
+
+        restore_interrupts(flags);
+
+        if (unlikely(trim)) kheap_trim();
+        return;
+    }
+
+    heap_count(false, 0);
+
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
+    heap_release(current);
+    bool trim = heap_should_trim();
+    spin_unlock_irqrestore(&heap_lock, flags);
+
+    if (unlikely(trim)) kheap_trim();
+}
+
+/*
+Cut an in-use segment down to `size` bytes, giving the remainder back to the
+free lists (where it merges with a free right neighbour) if it is big enough
+to stand on its own. The heap lock must be held.
+*/
+static void heap_shrink(HeapSegment* current, size_t size) {
+    if (current->size <= size + sizeof(HeapSegment) + HEAP_MIN_PAYLOAD) return;
+
+    HeapSegment* rest = (HeapSegment*)((uint64_t) current + sizeof(HeapSegment) + size);
+
+    rest->size       = current->size - size - sizeof(HeapSegment);
+    rest->is_free    = false;
+    rest->next       = current->next;
+    rest->prev       = current;
+    rest->magic      = HEAP_MAGIC;
+    rest->caller      = 0;
+    rest->in_magazine = false;
+    rest->prof_epoch  = 0;
+
+    if (current->next != NULL) current->next->prev = rest;
+    else                       last_segment = rest;
+
+    current->next = rest;
+    current->size = size;
+
+    // Both halves count as used until the remainder is released; only the new header is lost
+    heap_used_bytes -= sizeof(HeapSegment);
+    heap_segment_count++;
+
+    heap_release(rest);
+}
+
+/*
+Resize an allocation, keeping it where it is whenever possible:
+* Shrinking splits the tail off the segment (or off the vmalloc mapping).
+* Growing absorbs a free right-hand neighbour if together they are big enough,
+  or extends a vmalloc mapping into the pages after it.
+Only if neither works is a new block allocated and the data copied over.
+krealloc(NULL, size) is kmalloc, and krealloc(ptr, 0) is kfree.
+*/
+void* krealloc(void* ptr, size_t size) {
+    uint64_t caller = (uint64_t) __builtin_return_address(0);
+
+    if (unlikely(ptr == NULL)) return (size != 0) ? heap_kmalloc(size, caller) : NULL;
+
+    if (unlikely(size == 0)) {
+        kfree(ptr);
+        return NULL;
+    }
+
+    size_t old_size;
+
+    if (unlikely(IS_VMALLOC(ptr))) {
+        old_size = vmalloc_size(ptr);
+
+        if (unlikely(old_size == 0)) {
+            err_printf("krealloc: invalid vmalloc address %p\n", ptr);
+            return NULL;
+        }
+
+        // Shrinking below a page keeps the first page; it is not worth a copy
+        size_t target = (size < PAGE_SIZE) ? PAGE_SIZE : size;
+
+        if (vmalloc_resize(ptr, target)) {
+            heap_prof_resize_large(ptr, vmalloc_size(ptr));
+            return ptr;
+        }
+    } else {
+        HeapSegment* current = (HeapSegment*)((uint64_t) ptr - sizeof(HeapSegment));
+
+        if (unlikely(current->magic != HEAP_MAGIC || current->is_free || current->in_magazine)) {
+            err_printf("krealloc: invalid heap address %p\n", ptr);
+            return NULL;
+        }
+
+        old_size = current->size;
+        size_t aligned = (size + 15) & ~(size_t) 15;
+
+        // A block growing to a page or more moves over to vmalloc like any new one would
+        if (likely(aligned < PAGE_SIZE)) {
+            uint64_t flags = spin_lock_irqsave(&heap_lock);
+
+            HeapSegment* right = current->next;
+
+            if (aligned > current->size && right && right->is_free && right->magic == HEAP_MAGIC
+                && current->size + sizeof(HeapSegment) + right->size >= aligned) {
+                free_list_remove(right);
+
+                current->size += sizeof(HeapSegment) + right->size;
+                current->next = right->next;
+                if (current->next) current->next->prev = current;
+                else               last_segment = current;
+
+                heap_used_bytes += sizeof(HeapSegment) + right->size;
+                heap_segment_count--;
+
+                right->magic = 0;
+            }
+
+            bool fits = aligned <= current->size;
+            if (fits) heap_shrink(current, aligned);
+
+            spin_unlock_irqrestore(&heap_lock, flags);
+
+            if (fits) {
+                if (unlikely(current->prof_epoch != 0 && current->prof_epoch == heap_prof_epoch)) {
+                    heap_prof_resize(current->caller, old_size, current->size);
+                }
+
+                return ptr;
+            }
+        }
     }
 
-    spin_unlock(&heap_lock);
+    // Last resort: move it
+    void* new_ptr = heap_kmalloc(size, caller);
+    if (unlikely(new_ptr == NULL)) return NULL;
+
+    memcpy(new_ptr, ptr, (old_size < size) ? old_size : size);
+    kfree(ptr);
+
+    return new_ptr;
+}
+
+/* Usable size of an allocation, which may be more than was asked for */
+size_t ksize(void* ptr) {
+    if (unlikely(ptr == NULL)) return 0;
+    if (unlikely(IS_VMALLOC(ptr))) return vmalloc_size(ptr);
+
+    return ((HeapSegment*)((uint64_t) ptr - sizeof(HeapSegment)))->size;
 }
 
-/* Expand heap when exceeded */
-void kheap_expand(size_t size) {
+/*
+Grow the heap by at least `size` bytes. Steps grow geometrically with the heap
+(half its current size, within HEAP_EXPAND_MIN_KB and HEAP_EXPAND_MAX_KB), so a
+burst of allocations expands a handful of times instead of once per request.
+The new pages are appended through the tail pointer and merged into the last
+segment if it is free. Returns false if there was no memory to grow it with.
+*/
+bool kheap_expand(size_t size) {
     size_t total_needed = size + sizeof(HeapSegment);
-    size_t pages_to_alloc = (total_needed + PAGE_SIZE - 1) / PAGE_SIZE;
+    size_t pages_needed = (total_needed + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    uint64_t expand_flags = spin_lock_irqsave(&expand_lock);
+
+    size_t heap_size = (uint64_t) heap_end - (uint64_t) heap_start;
+    size_t step = heap_size / 2;
 
-    // Keep slow physical frame generation and page table mapping outside the spinlock range
-    for (size_t i = 0; i < pages_to_alloc; i++) {
-        void* phys = pmm_alloc_page();
-        vmm_map_page((uint64_t*) VIRTUAL_TO_PHYSICAL(kernel_directory),
-            phys, (void*)((uint64_t) heap_end + (i * PAGE_SIZE)),
-            PAGE_PRESENT | PAGE_RW | PAGE_CACHE);
+    if (step < HEAP_EXPAND_MIN_KB * 1024) step = HEAP_EXPAND_MIN_KB * 1024;
+    if (step > HEAP_EXPAND_MAX_KB * 1024) step = HEAP_EXPAND_MAX_KB * 1024;
+
+    size_t pages_to_alloc = step / PAGE_SIZE;
+    if (pages_to_alloc < pages_needed) pages_to_alloc = pages_needed;
+
+    // Only expand_lock guards heap_end's growth, so the slow frame allocation and
+    // page table mapping stay outside heap_lock
+    if (unlikely(!heap_map_pages(heap_end, pages_to_alloc))) {
+        spin_unlock_irqrestore(&expand_lock, expand_flags);
+        err_printf("kheap_expand: out of memory growing by %lu pages\n", pages_to_alloc);
+        return false;
     }
 
-    spin_lock(&heap_lock);
+    uint64_t flags = spin_lock_irqsave(&heap_lock);
 
     HeapSegment* new_seg = (HeapSegment*) heap_end;
     heap_end = (void*)((uint64_t) heap_end + (pages_to_alloc * PAGE_SIZE));
 
-    new_seg->size = (pages_to_alloc * PAGE_SIZE) - sizeof(HeapSegment);
-    new_seg->is_free = true;
-    new_seg->magic = HEAP_MAGIC;
+    new_seg->size    = (pages_to_alloc * PAGE_SIZE) - sizeof(HeapSegment);
+    new_seg->is_free = false;
+    new_seg->magic   = HEAP_MAGIC;
+    new_seg->caller  = 0;
+    new_seg->in_magazine = false;
+    new_seg->prof_epoch  = 0;
 
     // Link it to the end of the chain
-    HeapSegment* last = first_segment;
-    while (last->next != NULL) last = last->next;
-
-    last->next = new_seg;
-    new_seg->prev = last;
+    new_seg->prev = last_segment;
     new_seg->next = NULL;
+    last_segment->next = new_seg;
+    last_segment = new_seg;
+
+    // It is born in use so heap_release can take it back like any other segment
+    heap_used_bytes += new_seg->size;
+    heap_segment_count++;
 
-    spin_unlock(&heap_lock);
+    // Merge it into the tail directly; kfree would park a small one in a magazine
+    heap_release(new_seg);
 
-    // Safely execute merge cleanup via kfree wrapper
-    kfree((void*)((uint64_t) new_seg + sizeof(HeapSegment)));
+    spin_unlock_irqrestore(&heap_lock, flags);
+    spin_unlock_irqrestore(&expand_lock, expand_flags);
+
+    return true;
 }
 
-/* Total used memory by heap */
-size_t get_heap_total() {
-    size_t total = 0;
+/*
+Give the whole free pages at the end of the heap back to the PMM, keeping
+HEAP_TRIM_KEEP_KB of slack and never shrinking below the initial size. Called
+automatically once the free tail reaches HEAP_TRIM_AT_KB. Returns the number
+of bytes released.
+*/
+size_t kheap_trim() {
+    uint64_t expand_flags = spin_lock_irqsave(&expand_lock);
+    uint64_t flags        = spin_lock_irqsave(&heap_lock);
+
+    HeapSegment* tail = last_segment;
+
+    if (unlikely(!tail->is_free)) {
+        spin_unlock_irqrestore(&heap_lock, flags);
+        spin_unlock_irqrestore(&expand_lock, expand_flags);
+        return 0;
+    }
+
+    uint64_t new_end = (uint64_t) tail + sizeof(HeapSegment) + HEAP_TRIM_KEEP_KB * 1024;
+    new_end = (new_end + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+
+    uint64_t min_end = (uint64_t) heap_start + HEAP_INIT_SIZE_KB * 1024;
+    if (new_end < min_end) new_end = min_end;
 
-    spin_lock(&heap_lock);
+    uint64_t old_end = (uint64_t) heap_end;
 
-    HeapSegment* current = first_segment;
-    while (current != NULL) {
-        total += current->size + sizeof(HeapSegment);
-        current = current->next;
+    if (new_end >= old_end) {
+        spin_unlock_irqrestore(&heap_lock, flags);
+        spin_unlock_irqrestore(&expand_lock, expand_flags);
+        return 0;
     }
 
-    spin_unlock(&heap_lock);
+    // Shrink the tail in place; it changes size class, so it moves lists too
+    free_list_remove(tail);
+    tail->size = new_end - (uint64_t) tail - sizeof(HeapSegment);
+    free_list_insert(tail);
 
-    return total;
+    heap_end = (void*) new_end;
+
+    spin_unlock_irqrestore(&heap_lock, flags);
+
+    // Nothing can reach the pages past heap_end any more, and expand_lock keeps
+    // them from being handed out again until they are unmapped
+    if (unlikely(!vmm_unmap_range((uint64_t*) VIRTUAL_TO_PHYSICAL(kernel_directory),
+            (void*) new_end, (old_end - new_end) / PAGE_SIZE, true))) {
+        err_print("kheap_trim: out of memory splitting a large page, part of the tail stays mapped");
+    }
+
+    spin_unlock_irqrestore(&expand_lock, expand_flags);
+
+    return old_end - new_end;
 }
 
-/* Total memory used by non-free heap segments */
-size_t get_heap_used() {
-    size_t used = 0;
+/* Per-core magazine counters for the given core */
+void heap_magazine_stats(uint32_t core, HeapMagazineStats* out) {
+    HeapMagazine* mag = &heap_magazines[core];
 
-    spin_lock(&heap_lock);
+    out->hits   = mag->hits;
+    out->misses = mag->misses;
+    out->cached = 0;
 
-    HeapSegment* current = first_segment;
-    while (current != NULL) {
-        if (!current->is_free) {
-            used += current->size;
+    for (uint32_t i = 0; i < HEAP_MAG_CLASSES; i++) {
+        out->cached += mag->count[i];
+    }
+}
+
+/* Payload bytes parked in every core's magazines, which the heap counts as used */
+static size_t heap_cached_bytes() {
+    size_t cached = 0;
+
+    for (uint32_t core = 0; core < MAX_CORES; core++) {
+        cached += heap_magazines[core].cached_bytes;
+    }
+
+    return cached;
+}
+
+/*
+Heap totals and the per-core counters summed up. Nothing here takes the heap
+lock, so a monitor polling it never stalls an allocating core; the figures may
+be a few allocations apart from each other on a busy system.
+*/
+void heap_get_stats(HeapStats* out) {
+    out->total    = get_heap_total();
+    out->cached   = heap_cached_bytes();
+    out->used     = heap_used_bytes - out->cached;
+    out->segments = heap_segment_count;
+    out->vmalloc  = get_vmalloc_used();
+    out->allocs   = 0;
+    out->frees    = 0;
+
+    for (uint32_t i = 0; i < HEAP_CLASS_COUNT; i++) out->class_allocs[i] = 0;
+
+    for (uint32_t core = 0; core < MAX_CORES; core++) {
+        HeapMagazine* mag = &heap_magazines[core];
+
+        out->allocs += mag->allocs;
+        out->frees  += mag->frees;
+
+        for (uint32_t i = 0; i < HEAP_CLASS_COUNT; i++) {
+            out->class_allocs[i] += mag->class_allocs[i];
         }
-        current = current->next;
     }
+}
 
-    spin_unlock(&heap_lock);
+/* Total memory spanned by the heap, headers included */
+size_t get_heap_total() {
+    return (uint64_t) heap_end - (uint64_t) heap_start;
+}
 
-    return used;
+/* Total memory used by non-free heap segments, leaving out the idle ones in magazines */
+size_t get_heap_used() {
+    return heap_used_bytes - heap_cached_bytes();
 }
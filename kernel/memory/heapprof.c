@@ -0,0 +1,260 @@
+/*
+-----------------------------------------------------------------------
+Farix Operating System
+Copyright (C) 2026  Faris Muhammad
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+-----------------------------------------------------------------------
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "klib/string.h"
+
+#include "hal.h"
+
+#include "cpu/multicore.h"
+
+#include "memory/heapprof.h"
+
+typedef struct {
+    void*    ptr;
+    uint32_t caller;
+    uint32_t size;
+} HeapProfLarge;
+
+volatile bool    heap_prof_enabled = false;
+volatile uint8_t heap_prof_epoch   = 0; // Segments allocated while profiling are stamped with this
+
+static HeapProfSite  prof_sites[HEAP_PROF_SITES];
+static HeapProfLarge prof_large[HEAP_PROF_LARGE];
+
+static uint32_t prof_large_live = 0;
+static uint32_t prof_dropped    = 0; // Allocations not tracked because a table was full
+
+static spinlock prof_lock = 0; // Always taken with interrupts off, since kmalloc can run with them off
+
+/*
+Find the slot of a call site, claiming an empty one if `create` is set. Kernel
+addresses only differ in their low 32 bits, which is all `caller` keeps, so a
+multiplicative hash of it spreads sites well. The lock must be held.
+*/
+static HeapProfSite* prof_site(uint32_t caller, bool create) {
+    uint32_t slot = (caller * 2654435761U) % HEAP_PROF_SITES;
+
+    for (uint32_t i = 0; i < HEAP_PROF_SITES; i++) {
+        HeapProfSite* site = &prof_sites[(slot + i) % HEAP_PROF_SITES];
+
+        if (site->caller == caller) return site;
+
+        if (site->caller == 0) {
+            if (!create) return NULL;
+
+            site->caller = caller;
+            return site;
+        }
+    }
+
+    return NULL;
+}
+
+/* Start stamping new allocations and accounting them to their call site */
+void heap_prof_start() {
+    if (heap_prof_epoch == 0) heap_prof_epoch = 1;
+    heap_prof_enabled = true;
+}
+
+/* Stop tracking new allocations. Frees of tracked ones are still accounted. */
+void heap_prof_stop() {
+    heap_prof_enabled = false;
+}
+
+/*
+Forget every site. Bumping the epoch disowns all segments stamped so far, so
+their frees cannot push the fresh counters below zero.
+*/
+void heap_prof_reset() {
+    uint64_t flags = spin_lock_irqsave(&prof_lock);
+
+    memset(prof_sites, 0, sizeof(prof_sites));
+    memset(prof_large, 0, sizeof(prof_large));
+
+    prof_large_live = 0;
+    prof_dropped    = 0;
+
+    heap_prof_epoch++;
+    if (heap_prof_epoch == 0) heap_prof_epoch = 1;
+
+    spin_unlock_irqrestore(&prof_lock, flags);
+}
+
+/* Account an allocation of `size` bytes to its call site */
+void heap_prof_alloc(uint32_t caller, size_t size) {
+    uint64_t flags = spin_lock_irqsave(&prof_lock);
+
+    HeapProfSite* site = prof_site(caller, true);
+
+    if (likely(site != NULL)) {
+        site->allocs++;
+        site->live_count++;
+        site->live_bytes += size;
+
+        if (site->live_bytes > site->peak_bytes) site->peak_bytes = site->live_bytes;
+    } else {
+        prof_dropped++;
+    }
+
+    spin_unlock_irqrestore(&prof_lock, flags);
+}
+
+/* Take a freed allocation of `size` bytes off its call site */
+void heap_prof_free(uint32_t caller, size_t size) {
+    uint64_t flags = spin_lock_irqsave(&prof_lock);
+
+    HeapProfSite* site = prof_site(caller, false);
+
+    if (likely(site != NULL && site->live_count > 0)) {
+        site->live_count--;
+        site->live_bytes = (site->live_bytes > size) ? site->live_bytes - size : 0;
+    }
+
+    spin_unlock_irqrestore(&prof_lock, flags);
+}
+
+/* Account an allocation resized in place, without counting it as a new one */
+void heap_prof_resize(uint32_t caller, size_t old_size, size_t new_size) {
+    uint64_t flags = spin_lock_irqsave(&prof_lock);
+
+    HeapProfSite* site = prof_site(caller, false);
+
+    if (likely(site != NULL)) {
+        site->live_bytes = (site->live_bytes > old_size) ? site->live_bytes - old_size : 0;
+        site->live_bytes += new_size;
+
+        if (site->live_bytes > site->peak_bytes) site->peak_bytes = site->live_bytes;
+    }
+
+    spin_unlock_irqrestore(&prof_lock, flags);
+}
+
+/*
+vmalloc allocations have no header to stamp, so the ones made while profiling
+are remembered here to find their site again on free.
+*/
+void heap_prof_alloc_large(void* ptr, uint32_t caller, size_t size) {
+    uint64_t flags = spin_lock_irqsave(&prof_lock);
+
+    for (uint32_t i = 0; i < HEAP_PROF_LARGE; i++) {
+        if (prof_large[i].ptr == NULL) {
+            prof_large[i].ptr    = ptr;
+            prof_large[i].caller = caller;
+            prof_large[i].size   = (uint32_t) size;
+            prof_large_live++;
+
+            spin_unlock_irqrestore(&prof_lock, flags);
+
+            heap_prof_alloc(caller, size);
+            return;
+        }
+    }
+
+    prof_dropped++;
+    spin_unlock_irqrestore(&prof_lock, flags);
+}
+
+/* Account a vmalloc allocation's free, if it was tracked */
+void heap_prof_free_large(void* ptr) {
+    // Unlocked peek; nothing can be tracked without passing through alloc first
+    if (likely(prof_large_live == 0)) return;
+
+    uint64_t flags = spin_lock_irqsave(&prof_lock);
+
+    for (uint32_t i = 0; i < HEAP_PROF_LARGE; i++) {
+        if (prof_large[i].ptr == ptr) {
+            uint32_t caller = prof_large[i].caller;
+            uint32_t size   = prof_large[i].size;
+
+            prof_large[i].ptr = NULL;
+            prof_large_live--;
+
+            spin_unlock_irqrestore(&prof_lock, flags);
+
+            heap_prof_free(caller, size);
+            return;
+        }
+    }
+
+    spin_unlock_irqrestore(&prof_lock, flags);
+}
+
+/* Account a vmalloc allocation resized in place, if it was tracked */
+void heap_prof_resize_large(void* ptr, size_t size) {
+    if (likely(prof_large_live == 0)) return;
+
+    uint64_t flags = spin_lock_irqsave(&prof_lock);
+
+    for (uint32_t i = 0; i < HEAP_PROF_LARGE; i++) {
+        if (prof_large[i].ptr == ptr) {
+            uint32_t caller   = prof_large[i].caller;
+            uint32_t old_size = prof_large[i].size;
+
+            prof_large[i].size = (uint32_t) size;
+
+            spin_unlock_irqrestore(&prof_lock, flags);
+
+            heap_prof_resize(caller, old_size, size);
+            return;
+        }
+    }
+
+    spin_unlock_irqrestore(&prof_lock, flags);
+}
+
+/*
+Copy up to `max` sites, biggest live footprint first, into `out`. A simple
+insertion into the sorted output is plenty for a table this small. Returns the
+number of sites written.
+*/
+uint32_t heap_prof_top(HeapProfSite* out, uint32_t max) {
+    uint32_t count = 0;
+    if (unlikely(max == 0)) return 0;
+
+    uint64_t flags = spin_lock_irqsave(&prof_lock);
+
+    for (uint32_t i = 0; i < HEAP_PROF_SITES; i++) {
+        HeapProfSite* site = &prof_sites[i];
+        if (site->caller == 0) continue;
+
+        uint32_t pos = count;
+        while (pos > 0 && out[pos - 1].live_bytes < site->live_bytes) pos--;
+        if (pos >= max) continue;
+
+        uint32_t last = (count < max) ? count : max - 1;
+        for (uint32_t j = last; j > pos; j--) out[j] = out[j - 1];
+
+        out[pos] = *site;
+        if (count < max) count++;
+    }
+
+    spin_unlock_irqrestore(&prof_lock, flags);
+
+    return count;
+}
+
+/* Allocations that went untracked because a table was full since the last reset */
+uint32_t heap_prof_dropped() {
+    return prof_dropped;
+}
@@ -0,0 +1,341 @@
+/*
+-----------------------------------------------------------------------
+Farix Operating System
+Copyright (C) 2026  Faris Muhammad
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+-----------------------------------------------------------------------
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "klib/string.h"
+
+#include "hal.h"
+
+#include "cpu/multicore.h"
+#include "drivers/terminal.h"
+#include "memory/heap.h"
+#include "memory/pmm.h"
+#include "memory/vmalloc.h"
+#include "memory/vmm.h"
+#include "memory/zeropool.h"
+
+#include "memory/slab.h"
+
+#define KMEM_NONE          0xFFFF
+#define KMEM_DEFAULT_ALIGN 8
+
+#define KMEM_OBJECT(cache, slab, i) ((void*)((uintptr_t)(slab) + (cache)->data_offset + (uintptr_t)(i) * (cache)->object_size))
+
+KmemCache* kmem_caches = NULL;
+
+static spinlock kmem_caches_lock = 0; // This and every cache lock are taken with interrupts off
+
+/* Take a page from the PMM and lay a fresh slab out on it, constructing every object */
+static KmemSlab* create_slab(KmemCache* cache) {
+    void* phys = pmm_alloc_page();
+
+    // Out of frames; the other caches' empty reserves and the zeroed page pool are the first thing to go
+    if (unlikely(!phys)) {
+        kmem_reap();
+        zero_pool_drain();
+        phys = pmm_alloc_page();
+    }
+
+    if (unlikely(!phys)) {
+        err_printf("kmem_cache %s: pmm_alloc_page failed\n", cache->name);
+        return NULL;
+    }
+
+    pmm_set_owner(phys, 1, PAGE_OWNER_SLAB);
+
+    // The page is already reachable through the direct map
+    KmemSlab* slab = (KmemSlab*) PHYSICAL_TO_VIRTUAL(phys);
+
+    slab->magic      = KMEM_SLAB_MAGIC;
+    slab->cache      = cache;
+    slab->next       = NULL;
+    slab->prev       = NULL;
+    slab->free_head  = 0;
+    slab->free_count = cache->objects_per_slab;
+
+    for (uint32_t i = 0; i < cache->objects_per_slab; i++) {
+        slab->free_next[i] = (i + 1 < cache->objects_per_slab) ? i + 1 : KMEM_NONE;
+        if (cache->ctor) cache->ctor(KMEM_OBJECT(cache, slab, i));
+    }
+
+    return slab;
+}
+
+/* Give a slab's page back to the PMM */
+static inline void delete_slab(KmemSlab* slab) {
+    slab->magic = 0;
+    pmm_free_page((void*) VIRTUAL_TO_PHYSICAL(slab));
+}
+
+/* The list a slab belongs on, going by how many free objects it has */
+static inline KmemSlab** slab_list(KmemCache* cache, KmemSlab* slab) {
+    if (slab->free_count == 0)                      return &cache->slabs_full;
+    if (slab->free_count == cache->objects_per_slab) return &cache->slabs_empty;
+    return &cache->slabs_partial;
+}
+
+/* Push a slab onto the head of a list. The cache lock must be held. */
+static inline void slab_push(KmemSlab** list, KmemSlab* slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list) (*list)->prev = slab;
+    *list = slab;
+}
+
+/* Unlink a slab from a list. The cache lock must be held. */
+static inline void slab_remove(KmemSlab** list, KmemSlab* slab) {
+    if (slab->prev) slab->prev->next = slab->next;
+    else            *list            = slab->next;
+
+    if (slab->next) slab->next->prev = slab->prev;
+}
+
+/* Free a whole list of slabs, linked through `next` */
+static void delete_slabs(KmemSlab* slab) {
+    while (slab != NULL) {
+        KmemSlab* next = slab->next;
+        delete_slab(slab);
+        slab = next;
+    }
+}
+
+/*
+Create a named cache of `size` byte objects. `align` must be a power of two, or
+0 for the default of 8 bytes. The optional `ctor` is run once on every object
+when its slab is created, not on each allocation, so objects must be returned
+to that state before they are freed. As many objects as fit are packed into
+each one page slab.
+*/
+KmemCache* kmem_cache_create(const char* name, size_t size, size_t align, void (*ctor)(void*)) {
+    if (align == 0) align = KMEM_DEFAULT_ALIGN;
+
+    if (unlikely(size == 0 || size > KMEM_MAX_OBJECT_SIZE || (align & (align - 1)) != 0 || align > KMEM_MAX_OBJECT_SIZE)) {
+        err_printf("kmem_cache_create: invalid object size %lu / alignment %lu for %s\n", size, align, name);
+        return NULL;
+    }
+
+    KmemCache* cache = (KmemCache*) kmalloc(sizeof(KmemCache));
+    if (unlikely(!cache)) return NULL;
+
+    strncpy(cache->name, name, KMEM_NAME_LEN - 1);
+    cache->name[KMEM_NAME_LEN - 1] = '\0';
+
+    cache->object_size = (size + align - 1) & ~(align - 1);
+    cache->align       = align;
+    cache->ctor        = ctor;
+
+    // Each object costs its own size plus one free list index in the header
+    uint32_t count = (PAGE_SIZE - sizeof(KmemSlab)) / (cache->object_size + sizeof(uint16_t));
+    uint32_t offset;
+
+    while (1) {
+        offset = (sizeof(KmemSlab) + count * sizeof(uint16_t) + align - 1) & ~(align - 1);
+        if (offset + count * cache->object_size <= PAGE_SIZE) break;
+        count--;
+    }
+
+    cache->objects_per_slab = count;
+    cache->data_offset      = offset;
+
+    cache->slabs_partial  = NULL;
+    cache->slabs_full     = NULL;
+    cache->slabs_empty    = NULL;
+    cache->slab_count     = 0;
+    cache->empty_count    = 0;
+    cache->active_objects = 0;
+    cache->lock           = 0;
+
+    uint64_t flags = spin_lock_irqsave(&kmem_caches_lock);
+    cache->next = kmem_caches;
+    kmem_caches = cache;
+    spin_unlock_irqrestore(&kmem_caches_lock, flags);
+
+    return cache;
+}
+
+/* Free every slab of a cache and the cache itself. Objects still in use are lost. */
+void kmem_cache_destroy(KmemCache* cache) {
+    if (unlikely(!cache)) return;
+
+    uint64_t flags = spin_lock_irqsave(&kmem_caches_lock);
+
+    KmemCache** link = &kmem_caches;
+    while (*link != NULL && *link != cache) link = &(*link)->next;
+    if (likely(*link != NULL)) *link = cache->next;
+
+    spin_unlock_irqrestore(&kmem_caches_lock, flags);
+
+    if (unlikely(cache->active_objects != 0)) {
+        err_printf("kmem_cache_destroy: %s still has %lu objects in use\n", cache->name, cache->active_objects);
+    }
+
+    delete_slabs(cache->slabs_partial);
+    delete_slabs(cache->slabs_full);
+    delete_slabs(cache->slabs_empty);
+
+    kfree(cache);
+}
+
+/* Give every completely free slab of a cache back to the PMM, reserve included */
+void kmem_cache_shrink(KmemCache* cache) {
+    uint64_t flags = spin_lock_irqsave(&cache->lock);
+
+    KmemSlab* empty = cache->slabs_empty;
+
+    cache->slab_count -= cache->empty_count;
+    cache->slabs_empty = NULL;
+    cache->empty_count = 0;
+
+    spin_unlock_irqrestore(&cache->lock, flags);
+
+    delete_slabs(empty);
+}
+
+/*
+Shrink every cache. This is what memory pressure looks like to the slab layer:
+the empty slabs each cache keeps in reserve are the only pages it can give back
+without anybody noticing.
+*/
+void kmem_reap() {
+    uint64_t flags = spin_lock_irqsave(&kmem_caches_lock);
+
+    for (KmemCache* cache = kmem_caches; cache != NULL; cache = cache->next) {
+        kmem_cache_shrink(cache);
+    }
+
+    spin_unlock_irqrestore(&kmem_caches_lock, flags);
+}
+
+/*
+Allocate one object from the cache. Objects come from a partial slab if there is
+one, then from the empty reserve, and only then from a brand new slab, so this
+never looks at a full slab.
+*/
+void* kmem_cache_alloc(KmemCache* cache) {
+    if (unlikely(!cache)) return NULL;
+
+    uint64_t flags = spin_lock_irqsave(&cache->lock);
+
+    KmemSlab* slab = cache->slabs_partial;
+
+    if (unlikely(slab == NULL)) {
+        slab = cache->slabs_empty;
+
+        if (likely(slab != NULL)) {
+            slab_remove(&cache->slabs_empty, slab);
+            cache->empty_count--;
+        } else {
+            // Keep the slow page allocation and construction outside the lock
+            spin_unlock_irqrestore(&cache->lock, flags);
+
+            slab = create_slab(cache);
+            if (unlikely(!slab)) return NULL;
+
+            flags = spin_lock_irqsave(&cache->lock);
+            cache->slab_count++;
+        }
+
+        slab_push(&cache->slabs_partial, slab);
+    }
+
+    uint16_t index = slab->free_head;
+    slab->free_head = slab->free_next[index];
+    slab->free_count--;
+
+    if (unlikely(slab->free_count == 0)) {
+        slab_remove(&cache->slabs_partial, slab);
+        slab_push(&cache->slabs_full, slab);
+    }
+
+    cache->active_objects++;
+
+    spin_unlock_irqrestore(&cache->lock, flags);
+
+    return KMEM_OBJECT(cache, slab, index);
+}
+
+/*
+Return an object to its cache, moving its slab to the list it now belongs on.
+A cache keeps up to KMEM_EMPTY_RESERVE completely free slabs so that a burst of
+frees followed by allocations does not bounce pages through the PMM; past that,
+empty slabs go straight back.
+*/
+void kmem_cache_free(KmemCache* cache, void* ptr) {
+    if (unlikely(ptr == NULL)) return;
+
+    KmemSlab* slab = (KmemSlab*)((uintptr_t) ptr & ~(uintptr_t)(PAGE_SIZE - 1));
+
+    if (unlikely(slab->magic != KMEM_SLAB_MAGIC || slab->cache != cache)) {
+        err_printf("kmem_cache_free: %p does not belong to cache %s\n", ptr, cache->name);
+        return;
+    }
+
+    uintptr_t offset = (uintptr_t) ptr - (uintptr_t) slab - cache->data_offset;
+    uint32_t  index  = offset / cache->object_size;
+
+    if (unlikely(offset % cache->object_size != 0 || index >= cache->objects_per_slab)) {
+        err_printf("kmem_cache_free: %p is not an object of cache %s\n", ptr, cache->name);
+        return;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&cache->lock);
+
+    slab_remove(slab_list(cache, slab), slab);
+
+    slab->free_next[index] = slab->free_head;
+    slab->free_head = index;
+    slab->free_count++;
+
+    cache->active_objects--;
+
+    bool should_free_slab = false;
+
+    if (slab->free_count == cache->objects_per_slab) {
+        if (cache->empty_count < KMEM_EMPTY_RESERVE) {
+            slab_push(&cache->slabs_empty, slab);
+            cache->empty_count++;
+        } else {
+            cache->slab_count--;
+            should_free_slab = true;
+        }
+    } else {
+        slab_push(&cache->slabs_partial, slab);
+    }
+
+    spin_unlock_irqrestore(&cache->lock, flags);
+
+    if (should_free_slab) delete_slab(slab);
+}
+
+/*
+The cache an object was allocated from, or NULL if `ptr` is not in a slab. Only
+meant for callers like AcpiOsFree that get handed both slab objects and heap
+blocks; the page's magic decides.
+*/
+KmemCache* kmem_cache_of(void* ptr) {
+    // A vmalloc block starts on a page boundary, so its page base is caller data
+    if (unlikely(ptr == NULL || IS_VMALLOC(ptr))) return NULL;
+
+    KmemSlab* slab = (KmemSlab*)((uintptr_t) ptr & ~(uintptr_t)(PAGE_SIZE - 1));
+    return (slab->magic == KMEM_SLAB_MAGIC) ? slab->cache : NULL;
+}
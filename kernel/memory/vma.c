@@ -0,0 +1,226 @@
+/*
+-----------------------------------------------------------------------
+Farix Operating System
+Copyright (C) 2026  Faris Muhammad
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+-----------------------------------------------------------------------
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hal.h"
+
+#include "drivers/terminal.h"
+#include "memory/pmm.h"
+#include "memory/slab.h"
+#include "memory/vmm.h"
+#include "memory/zeropool.h"
+#include "process/task.h"
+
+#include "memory/vma.h"
+
+#define USER_SPACE_END 0x0000800000000000ULL // Lower half, the only part a VMA can cover
+
+static KmemCache* vma_cache = NULL;
+
+// One frame of zeroes, mapped read-only wherever a page is read before it is written
+static void* vma_zero_frame = NULL;
+
+/*
+Create the object cache VMAs come from, and the shared zero frame. The frame keeps
+the reference it was allocated with for good, so every process mapping it leaves
+it shared and it is never freed.
+*/
+void init_vma() {
+    vma_cache = kmem_cache_create("Vma", sizeof(Vma), 32, NULL);
+
+    vma_zero_frame = pmm_alloc_zeroed_page();
+    if (likely(vma_zero_frame != NULL)) pmm_set_owner(vma_zero_frame, 1, PAGE_OWNER_USER);
+}
+
+/*
+Add the range [start, end) with `flags` to the list `vmas`, rounded out to whole
+pages, keeping the list sorted by start address. Nothing is mapped; the pages are
+given frames by vma_handle_fault as they are touched. Returns NULL if the range is
+empty or not in the lower half.
+*/
+Vma* vma_add(Vma** vmas, uint64_t start, uint64_t end, uint32_t flags) {
+    start = start & ~(uint64_t)(PAGE_SIZE - 1);
+    end   = (end + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+
+    if (unlikely(start >= end || end > USER_SPACE_END)) return NULL;
+
+    Vma* vma = (Vma*) kmem_cache_alloc(vma_cache);
+    if (unlikely(vma == NULL)) {
+        err_print("vma_add: out of memory");
+        return NULL;
+    }
+
+    vma->start = start;
+    vma->end   = end;
+    vma->flags = flags;
+
+    Vma** link = vmas;
+    while (*link != NULL && (*link)->start < start) link = &(*link)->next;
+
+    vma->next = *link;
+    *link     = vma;
+
+    return vma;
+}
+
+/* The VMA in `vmas` holding `addr`, or NULL if none does */
+Vma* vma_find(Vma* vmas, uint64_t addr) {
+    for (Vma* vma = vmas; vma != NULL && vma->start <= addr; vma = vma->next) {
+        if (addr < vma->end) return vma;
+    }
+
+    return NULL;
+}
+
+/* Free every VMA in `vmas` and leave it empty. Whatever they mapped stays mapped. */
+void vma_free_all(Vma** vmas) {
+    Vma* vma = *vmas;
+
+    while (vma != NULL) {
+        Vma* next = vma->next;
+        kmem_cache_free(vma_cache, vma);
+        vma = next;
+    }
+
+    *vmas = NULL;
+}
+
+/*
+Copy every VMA in `src` into the empty list `dst`, in the same order, for a forked
+process. Returns false if memory ran out, leaving `dst` empty.
+*/
+bool vma_copy_all(Vma** dst, Vma* src) {
+    Vma** link = dst;
+
+    for (Vma* vma = src; vma != NULL; vma = vma->next) {
+        Vma* copy = (Vma*) kmem_cache_alloc(vma_cache);
+
+        if (unlikely(copy == NULL)) {
+            *link = NULL;
+            vma_free_all(dst);
+            return false;
+        }
+
+        *copy = *vma;
+        *link = copy;
+        link  = &copy->next;
+    }
+
+    *link = NULL;
+    return true;
+}
+
+/*
+The stack VMA `addr` would fall into if it grew down to cover it, which it can do
+until it spans VMA_STACK_MAX. Only the first VMA above `addr` is looked at, since
+the stack cannot grow past any other.
+*/
+static Vma* vma_find_stack(Vma* vmas, uint64_t addr) {
+    Vma* vma = vmas;
+    while (vma != NULL && vma->start <= addr) vma = vma->next;
+
+    if (vma == NULL || !(vma->flags & VMA_STACK) || vma->end - addr > VMA_STACK_MAX) return NULL;
+
+    return vma;
+}
+
+/*
+Resolve a page fault at `addr` for task `t`, with the error code the CPU pushed.
+A fault on a page that is not mapped, inside one of the task's VMAs (or just
+below its stack, which then grows down to it), gets the shared zero frame if it
+was a read, or a zeroed frame of its own if it was a write. A write to a mapped
+page of a writable VMA is either the zero frame, which is swapped for a private
+frame, or a copy-on-write share left by a fork, which vmm_resolve_cow gives a
+frame of its own. Returns false for anything else, which is a genuine fault.
+*/
+bool vma_handle_fault(task* t, uint64_t addr, uint64_t err_code) {
+    if (unlikely(t == NULL || addr >= USER_SPACE_END)) return false;
+
+    Vma* vma = vma_find(t->vmas, addr);
+    void* page_addr = (void*)(addr & ~(uint64_t)(PAGE_SIZE - 1));
+
+    if (err_code & PAGE_FAULT_PRESENT) {
+        if (vma == NULL || !(err_code & PAGE_FAULT_WRITE) || !(vma->flags & VMA_WRITE)) return false;
+
+        if (vmm_get_phys(t->page_directory, page_addr) != (uint64_t) vma_zero_frame) {
+            return vmm_resolve_cow(t->page_directory, page_addr);
+        }
+
+        // Nothing to copy out of the zero frame, so a zeroed one replaces it
+        void* phys = pmm_alloc_zeroed_page();
+        if (unlikely(phys == NULL)) {
+            err_printf("vma_handle_fault: out of memory at %p\n", (void*) addr);
+            return false;
+        }
+
+        pmm_set_owner(phys, 1, PAGE_OWNER_USER);
+
+        if (unlikely(!vmm_map_page(t->page_directory, phys, page_addr, PAGE_PRESENT | PAGE_RW | PAGE_USER | PAGE_CACHE))) {
+            pmm_free_page(phys);
+            err_printf("vma_handle_fault: out of memory at %p\n", (void*) addr);
+            return false;
+        }
+
+        pmm_free_page(vma_zero_frame);
+        return true;
+    }
+
+    if (unlikely(vma == NULL)) {
+        vma = vma_find_stack(t->vmas, addr);
+        if (vma == NULL) return false;
+
+        vma->start = addr & ~(uint64_t)(PAGE_SIZE - 1);
+    }
+
+    if (unlikely((err_code & PAGE_FAULT_WRITE) && !(vma->flags & VMA_WRITE))) return false;
+
+    // A read only needs to see zeroes, and a mapping of them costs no memory
+    if (!(err_code & PAGE_FAULT_WRITE) && likely(vma_zero_frame != NULL)) {
+        pmm_page_get(pmm_page(vma_zero_frame));
+
+        if (likely(vmm_map_page(t->page_directory, vma_zero_frame, page_addr, PAGE_PRESENT | PAGE_USER | PAGE_CACHE))) return true;
+
+        pmm_free_page(vma_zero_frame);
+        err_printf("vma_handle_fault: out of memory at %p\n", (void*) addr);
+        return false;
+    }
+
+    void* phys = pmm_alloc_zeroed_page();
+    if (unlikely(phys == NULL)) {
+        err_printf("vma_handle_fault: out of memory at %p\n", (void*) addr);
+        return false;
+    }
+
+    pmm_set_owner(phys, 1, PAGE_OWNER_USER);
+
+    uint64_t flags = PAGE_PRESENT | PAGE_USER | PAGE_CACHE;
+    if (vma->flags & VMA_WRITE) flags |= PAGE_RW;
+
+    if (unlikely(!vmm_map_page(t->page_directory, phys, page_addr, flags))) {
+        pmm_free_page(phys);
+        err_printf("vma_handle_fault: out of memory at %p\n", (void*) addr);
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,298 @@
+/*
+-----------------------------------------------------------------------
+Farix Operating System
+Copyright (C) 2026  Faris Muhammad
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+-----------------------------------------------------------------------
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hal.h"
+
+#include "cpu/multicore.h"
+#include "drivers/terminal.h"
+#include "memory/pmm.h"
+#include "memory/vmm.h"
+
+#include "memory/vmalloc.h"
+
+#define VMALLOC_PAGES (VMALLOC_SIZE / PAGE_SIZE)
+#define VMALLOC_WORDS (VMALLOC_PAGES / 64)
+
+// A page of the region is set in `vmalloc_used` while it is reserved, guard pages
+// included, and in `vmalloc_last` if it is the final mapped page of an allocation.
+// Together they give back an allocation's length on free without any header.
+static uint64_t vmalloc_used[VMALLOC_WORDS];
+static uint64_t vmalloc_last[VMALLOC_WORDS];
+
+static uint64_t vmalloc_hint       = 0; // Page index the next search starts from
+static uint64_t vmalloc_used_pages = 0;
+
+static spinlock vmalloc_lock = 0; // Always taken with interrupts off, like the heap lock in front of it
+
+static inline bool vmalloc_test(uint64_t* bitmap, uint64_t page) {
+    return (bitmap[page >> 6] >> (page & 63)) & 1;
+}
+
+static inline void vmalloc_set(uint64_t* bitmap, uint64_t page) {
+    bitmap[page >> 6] |= (1ULL << (page & 63));
+}
+
+static inline void vmalloc_clear(uint64_t* bitmap, uint64_t page) {
+    bitmap[page >> 6] &= ~(1ULL << (page & 63));
+}
+
+/*
+Find `span` consecutive unreserved pages in [from, to), skipping fully reserved
+words in one step. Returns the first page of the run, or -1 if there is none.
+*/
+static int64_t vmalloc_find_run(uint64_t from, uint64_t to, uint64_t span) {
+    uint64_t run = 0;
+
+    for (uint64_t i = from; i < to; i++) {
+        if ((i & 63) == 0 && vmalloc_used[i >> 6] == ~0ULL) {
+            i += 63;
+            run = 0;
+            continue;
+        }
+
+        if (vmalloc_test(vmalloc_used, i)) run = 0;
+        else if (++run == span) return (int64_t)(i - span + 1);
+    }
+
+    return -1;
+}
+
+/*
+An allocation starts at a reserved page whose previous page is either free or
+the guard page right after another allocation. The lock must be held.
+*/
+static bool vmalloc_is_start(uint64_t page) {
+    if (unlikely(!vmalloc_test(vmalloc_used, page))) return false;
+    if (page == 0) return true;
+
+    // The previous page is mapped, so this would be a guard page
+    if (vmalloc_test(vmalloc_last, page - 1)) return false;
+
+    if (!vmalloc_test(vmalloc_used, page - 1)) return true;
+    return page >= 2 && vmalloc_test(vmalloc_last, page - 2);
+}
+
+/* Number of mapped pages of the allocation starting at `page`. The lock must be held. */
+static uint64_t vmalloc_length(uint64_t page) {
+    uint64_t end = page;
+    while (!vmalloc_test(vmalloc_last, end)) end++;
+    return end - page + 1;
+}
+
+/*
+Allocate `size` bytes, rounded up to whole pages, in the vmalloc region. Every
+page is backed by a fresh PMM frame, and an unmapped guard page is left after
+the allocation so that an overrun faults instead of corrupting its neighbour.
+*/
+void* vmalloc(size_t size) {
+    if (unlikely(size == 0)) return NULL;
+
+    uint64_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint64_t span  = pages + 1;
+
+    uint64_t flags = spin_lock_irqsave(&vmalloc_lock);
+
+    int64_t start = vmalloc_find_run(vmalloc_hint, VMALLOC_PAGES, span);
+    if (unlikely(start < 0)) start = vmalloc_find_run(0, VMALLOC_PAGES, span);
+
+    if (unlikely(start < 0)) {
+        spin_unlock_irqrestore(&vmalloc_lock, flags);
+        err_printf("vmalloc: no virtual space left for %lu pages\n", pages);
+        return NULL;
+    }
+
+    for (uint64_t i = 0; i < span; i++) vmalloc_set(vmalloc_used, start + i);
+    vmalloc_set(vmalloc_last, start + pages - 1);
+
+    vmalloc_hint        = start + span;
+    vmalloc_used_pages += pages;
+
+    spin_unlock_irqrestore(&vmalloc_lock, flags);
+
+    // The range is ours now, so the slow frame allocation and mapping can run unlocked
+    uint64_t virt = VMALLOC_START + (uint64_t) start * PAGE_SIZE;
+
+    for (uint64_t i = 0; i < pages; i++) {
+        void* phys = pmm_alloc_page();
+
+        if (likely(phys != NULL)) {
+            pmm_set_owner(phys, 1, PAGE_OWNER_VMALLOC);
+
+            if (likely(vmm_map_page((uint64_t*) VIRTUAL_TO_PHYSICAL(kernel_directory),
+                    phys, (void*)(virt + i * PAGE_SIZE), PAGE_PRESENT | PAGE_RW | PAGE_CACHE))) continue;
+
+            pmm_free_page(phys);
+        }
+
+        // Either the frame or a page table for it could not be had
+        err_printf("vmalloc: out of physical memory after %lu of %lu pages\n", i, pages);
+
+        vmm_unmap_range((uint64_t*) VIRTUAL_TO_PHYSICAL(kernel_directory), (void*) virt, i, true);
+
+        flags = spin_lock_irqsave(&vmalloc_lock);
+
+        for (uint64_t j = 0; j < span; j++) vmalloc_clear(vmalloc_used, start + j);
+        vmalloc_clear(vmalloc_last, start + pages - 1);
+
+        vmalloc_used_pages -= pages;
+        if ((uint64_t) start < vmalloc_hint) vmalloc_hint = start;
+
+        spin_unlock_irqrestore(&vmalloc_lock, flags);
+        return NULL;
+    }
+
+    return (void*) virt;
+}
+
+/* Unmap an allocation made by vmalloc and give its frames back to the PMM */
+void vfree(void* ptr) {
+    if (unlikely(ptr == NULL)) return;
+
+    uint64_t offset = (uint64_t) ptr - VMALLOC_START;
+    uint64_t page   = offset / PAGE_SIZE;
+
+    if (unlikely(!IS_VMALLOC(ptr) || (offset & (PAGE_SIZE - 1)) != 0)) {
+        err_printf("vfree: %p is not a vmalloc address\n", ptr);
+        return;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&vmalloc_lock);
+
+    if (unlikely(!vmalloc_is_start(page))) {
+        spin_unlock_irqrestore(&vmalloc_lock, flags);
+        err_printf("vfree: %p is not an allocation (double free?)\n", ptr);
+        return;
+    }
+
+    uint64_t pages = vmalloc_length(page);
+
+    // The range stays reserved while it is torn down, so nobody can map over it
+    vmm_unmap_range((uint64_t*) VIRTUAL_TO_PHYSICAL(kernel_directory), ptr, pages, true);
+
+    for (uint64_t i = 0; i <= pages; i++) vmalloc_clear(vmalloc_used, page + i);
+    vmalloc_clear(vmalloc_last, page + pages - 1);
+
+    vmalloc_used_pages -= pages;
+    if (page < vmalloc_hint) vmalloc_hint = page;
+
+    spin_unlock_irqrestore(&vmalloc_lock, flags);
+}
+
+/*
+Resize a vmalloc allocation without moving it. Shrinking unmaps the tail pages
+and moves the guard page down. Growing needs the pages right after the guard to
+be free; the old guard is then mapped and a new one reserved past the end.
+Returns whether the allocation now holds `size` bytes.
+*/
+bool vmalloc_resize(void* ptr, size_t size) {
+    if (unlikely(size == 0 || !IS_VMALLOC(ptr) || ((uint64_t) ptr & (PAGE_SIZE - 1)) != 0)) return false;
+
+    uint64_t page      = ((uint64_t) ptr - VMALLOC_START) / PAGE_SIZE;
+    uint64_t new_pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    uint64_t flags = spin_lock_irqsave(&vmalloc_lock);
+
+    if (unlikely(!vmalloc_is_start(page))) {
+        spin_unlock_irqrestore(&vmalloc_lock, flags);
+        return false;
+    }
+
+    uint64_t pages = vmalloc_length(page);
+
+    if (new_pages < pages) {
+        vmm_unmap_range((uint64_t*) VIRTUAL_TO_PHYSICAL(kernel_directory),
+            (void*)((uint64_t) ptr + new_pages * PAGE_SIZE), pages - new_pages, true);
+
+        // Page `new_pages` is the new guard, everything past it up to the old guard is free
+        for (uint64_t i = new_pages + 1; i <= pages; i++) vmalloc_clear(vmalloc_used, page + i);
+
+        vmalloc_clear(vmalloc_last, page + pages - 1);
+        vmalloc_set(vmalloc_last, page + new_pages - 1);
+
+        vmalloc_used_pages -= pages - new_pages;
+        if (page + new_pages + 1 < vmalloc_hint) vmalloc_hint = page + new_pages + 1;
+    }
+    else if (new_pages > pages) {
+        if (unlikely(page + new_pages >= VMALLOC_PAGES)) {
+            spin_unlock_irqrestore(&vmalloc_lock, flags);
+            return false;
+        }
+
+        // The old guard is ours already, the pages after it up to the new guard must be free
+        for (uint64_t i = pages + 1; i <= new_pages; i++) {
+            if (vmalloc_test(vmalloc_used, page + i)) {
+                spin_unlock_irqrestore(&vmalloc_lock, flags);
+                return false;
+            }
+        }
+
+        for (uint64_t i = pages; i < new_pages; i++) {
+            void* phys = pmm_alloc_page();
+
+            if (likely(phys != NULL)) {
+                pmm_set_owner(phys, 1, PAGE_OWNER_VMALLOC);
+
+                if (likely(vmm_map_page((uint64_t*) VIRTUAL_TO_PHYSICAL(kernel_directory),
+                        phys, (void*)((uint64_t) ptr + i * PAGE_SIZE), PAGE_PRESENT | PAGE_RW | PAGE_CACHE))) continue;
+
+                pmm_free_page(phys);
+            }
+
+            vmm_unmap_range((uint64_t*) VIRTUAL_TO_PHYSICAL(kernel_directory),
+                (void*)((uint64_t) ptr + pages * PAGE_SIZE), i - pages, true);
+
+            spin_unlock_irqrestore(&vmalloc_lock, flags);
+            return false;
+        }
+
+        for (uint64_t i = pages + 1; i <= new_pages; i++) vmalloc_set(vmalloc_used, page + i);
+
+        vmalloc_clear(vmalloc_last, page + pages - 1);
+        vmalloc_set(vmalloc_last, page + new_pages - 1);
+
+        vmalloc_used_pages += new_pages - pages;
+    }
+
+    spin_unlock_irqrestore(&vmalloc_lock, flags);
+    return true;
+}
+
+/* Usable size of a vmalloc allocation, or 0 if `ptr` is not the start of one */
+size_t vmalloc_size(void* ptr) {
+    if (unlikely(!IS_VMALLOC(ptr) || ((uint64_t) ptr & (PAGE_SIZE - 1)) != 0)) return 0;
+
+    uint64_t page = ((uint64_t) ptr - VMALLOC_START) / PAGE_SIZE;
+    size_t size = 0;
+
+    uint64_t flags = spin_lock_irqsave(&vmalloc_lock);
+    if (likely(vmalloc_is_start(page))) size = vmalloc_length(page) * PAGE_SIZE;
+    spin_unlock_irqrestore(&vmalloc_lock, flags);
+
+    return size;
+}
+
+/* Bytes currently mapped in the vmalloc region, guard pages excluded */
+size_t get_vmalloc_used() {
+    return vmalloc_used_pages * PAGE_SIZE;
+}
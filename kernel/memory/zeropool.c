@@ -0,0 +1,129 @@
+/*
+-----------------------------------------------------------------------
+Farix Operating System
+Copyright (C) 2026  Faris Muhammad
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+-----------------------------------------------------------------------
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "klib/string.h"
+
+#include "hal.h"
+
+#include "cpu/multicore.h"
+#include "memory/pmm.h"
+#include "memory/vmm.h"
+
+#include "memory/zeropool.h"
+
+// Physical addresses of frames that are already all zeroes
+static uint64_t zero_pool[ZERO_POOL_SIZE];
+static uint32_t zero_pool_count = 0;
+
+static uint64_t zero_pool_hits   = 0;
+static uint64_t zero_pool_misses = 0;
+
+static spinlock zero_pool_lock = 0; // Taken with interrupts off, since page faults take zeroed frames
+
+/*
+Allocate a physical frame that is all zeroes. Frames come out of the pool the
+zeroing task fills while the system is idle, so page table growth and process
+creation do not clear a page inline. If the pool is empty, a frame is taken
+from the PMM and cleared here instead.
+*/
+void* pmm_alloc_zeroed_page() {
+    uint64_t flags = spin_lock_irqsave(&zero_pool_lock);
+
+    if (likely(zero_pool_count > 0)) {
+        uint64_t phys = zero_pool[--zero_pool_count];
+        zero_pool_hits++;
+
+        spin_unlock_irqrestore(&zero_pool_lock, flags);
+        return (void*) phys;
+    }
+
+    zero_pool_misses++;
+    spin_unlock_irqrestore(&zero_pool_lock, flags);
+
+    void* phys = pmm_alloc_page();
+    if (likely(phys != NULL)) memset(PHYSICAL_TO_VIRTUAL(phys), 0, PAGE_SIZE);
+
+    return phys;
+}
+
+/* Give every pooled frame back to the PMM, for when memory runs short */
+void zero_pool_drain() {
+    uint64_t flags = spin_lock_irqsave(&zero_pool_lock);
+
+    while (zero_pool_count > 0) {
+        pmm_free_page((void*) zero_pool[--zero_pool_count]);
+    }
+
+    spin_unlock_irqrestore(&zero_pool_lock, flags);
+}
+
+/*
+Low priority kernel task that keeps the pool topped up. It clears a batch of
+frames at a time outside the lock, adds them, and yields; once the pool is full
+it halts until the next interrupt, so it only ever uses time nothing else wants.
+*/
+void zero_pool_thread() {
+    uint64_t batch[ZERO_POOL_BATCH];
+
+    while (1) {
+        uint32_t want = ZERO_POOL_SIZE - zero_pool_count;
+
+        if (want == 0) {
+            system_halt();
+            continue;
+        }
+
+        if (want > ZERO_POOL_BATCH) want = ZERO_POOL_BATCH;
+
+        uint32_t count = 0;
+
+        while (count < want) {
+            void* phys = pmm_alloc_page();
+            if (unlikely(phys == NULL)) break;
+
+            memset(PHYSICAL_TO_VIRTUAL(phys), 0, PAGE_SIZE);
+            batch[count++] = (uint64_t) phys;
+        }
+
+        // Only this task adds to the pool, so the room counted above is still there
+        uint64_t flags = spin_lock_irqsave(&zero_pool_lock);
+        for (uint32_t i = 0; i < count; i++) zero_pool[zero_pool_count++] = batch[i];
+        spin_unlock_irqrestore(&zero_pool_lock, flags);
+
+        // Out of memory: wait for frees rather than spin on the PMM
+        if (count < want) system_halt();
+        else              task_yield();
+    }
+}
+
+/* Snapshot of the pool's size and hit counters */
+void zero_pool_stats(ZeroPoolStats* stats) {
+    uint64_t flags = spin_lock_irqsave(&zero_pool_lock);
+
+    stats->cached = zero_pool_count;
+    stats->hits   = zero_pool_hits;
+    stats->misses = zero_pool_misses;
+
+    spin_unlock_irqrestore(&zero_pool_lock, flags);
+}
@@ -28,6 +28,8 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "memory/heap.h"
 #include "memory/pmm.h"
+#include "memory/slab.h"
+#include "memory/vma.h"
 #include "memory/vmm.h"
 
 #include "fs/types/elf.h"
@@ -50,6 +52,12 @@ uint64_t next_pid  = INIT_TASK_ID;
 task_list* first_task_list = NULL;
 task_list* current_task_list = NULL;
 
+static KmemCache* task_cache      = NULL;
+static KmemCache* task_list_cache = NULL;
+
+// Tasks that killed themselves, linked through `neighbor`, waiting for task_reaper_thread
+static task* dead_tasks = NULL;
+
 /* Task trampoline that executes the task, then kills the task upon termination */
 static void task_trampoline() {
     system_int_on();
@@ -65,7 +73,11 @@ static void task_trampoline() {
 
 /* Initialise multitasking by creating the init task */
 void init_multitasking() {
-    main_task = (task*) kmalloc(sizeof(task));
+    task_cache      = kmem_cache_create("task", sizeof(task), KMEM_CACHE_LINE, NULL);
+    task_list_cache = kmem_cache_create("task_list", sizeof(task_list), KMEM_CACHE_LINE, NULL);
+    init_vma();
+
+    main_task = (task*) kmem_cache_alloc(task_cache);
     memset(main_task, 0, sizeof(task));
 
     main_task->id    = next_pid++;
@@ -80,7 +92,7 @@ void init_multitasking() {
 
     current_task = main_task;
 
-    current_task_list = (task_list*) kmalloc(sizeof(task_list));
+    current_task_list = (task_list*) kmem_cache_alloc(task_list_cache);
     memset(current_task_list, 0, sizeof(task_list));
 
     current_task_list->tasks[0]  = main_task;
@@ -92,7 +104,7 @@ void init_multitasking() {
 
 /* Create new task to execute the `entry_point` with given name and privilege */
 task* create_task(void (*entry_point)(void*), const char* name, const int privilege, void* args) {
-    task* new_task = (task*) kmalloc(sizeof(task));
+    task* new_task = (task*) kmem_cache_alloc(task_cache);
     memset(new_task, 0, sizeof(task));
 
     new_task->id             = next_pid++;
@@ -149,7 +161,7 @@ task* create_task(void (*entry_point)(void*), const char* name, const int privil
     new_task->stack_origin  = stack;
 
     if (unlikely(current_task_list->mask == TASK_LIST_MASK_FULL)) {
-        task_list* new_task_list = (task_list*) kmalloc(sizeof(task_list));
+        task_list* new_task_list = (task_list*) kmem_cache_alloc(task_list_cache);
         memset(new_task_list, 0, sizeof(task_list));
 
         new_task_list->next = NULL;
@@ -216,10 +228,19 @@ void kill_task(uint64_t id) {
         target_list->mask &= ~(1ULL << slot_index);
         target_list->tasks[slot_index] = NULL;
 
-        if (target->stack_origin) kfree(target->stack_origin);
-        kfree(target);
+        vma_free_all(&target->vmas);
+        vmm_destroy_address_space(target->page_directory);
 
-        if (unlikely(target == current_task)) task_yield();
+        if (unlikely(target == current_task)) {
+            // This is still running on its stack, and schedule() saves its RSP into it
+            target->neighbor = dead_tasks;
+            dead_tasks       = target;
+
+            task_yield();
+        } else {
+            if (target->stack_origin) kfree(target->stack_origin);
+            kmem_cache_free(task_cache, target);
+        }
     }
 
     system_int_on();
@@ -227,6 +248,39 @@ void kill_task(uint64_t id) {
     if (unlikely(target == current_task)) task_yield();
 }
 
+/*
+Kernel task that frees the stacks and task structs of tasks that killed
+themselves. kill_task cannot free them while it is still running on that stack,
+so it leaves them on dead_tasks, and this picks them up once the scheduler has
+switched away. With nothing to free, it halts until the next interrupt.
+*/
+void task_reaper_thread() {
+    while (1) {
+        uint64_t flags = save_disable_interrupts();
+
+        task* dead = dead_tasks;
+        dead_tasks = NULL;
+
+        restore_interrupts(flags);
+
+        if (dead == NULL) {
+            system_halt();
+            continue;
+        }
+
+        while (dead != NULL) {
+            task* next = dead->neighbor;
+
+            if (dead->stack_origin) kfree(dead->stack_origin);
+            kmem_cache_free(task_cache, dead);
+
+            dead = next;
+        }
+
+        task_yield();
+    }
+}
+
 /* Scheduler, called by interrupts, switches to the next task. */
 void schedule() {
     if (unlikely((next_pid >> 1) == INIT_TASK_ID)) return;
@@ -289,7 +343,7 @@ size_t clean_task_lists() {
          }
 
          list->next = next->next;
-         kfree((void*) next);
+         kmem_cache_free(task_list_cache, next);
 
          count++;
     }
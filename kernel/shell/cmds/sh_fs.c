@@ -242,7 +242,7 @@ void cmd_ls(const char* args) {
         }
 
         temp = head->next;
-        kfree(head);
+        fs_free_node(head);
         head = temp;
     }
 }
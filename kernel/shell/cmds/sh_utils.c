@@ -26,8 +26,13 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "hal.h"
 
+#include "cpu/multicore.h"
 #include "drivers/terminal.h"
 #include "memory/heap.h"
+#include "memory/heapprof.h"
+#include "memory/pmm.h"
+#include "memory/vmalloc.h"
+#include "memory/zeropool.h"
 
 #include "shell/commands.h"
 #include "shell/shell.h"
@@ -68,8 +73,59 @@ void cmd_secho(const char* args) {
     // uart_putc('\n');
 }
 
-/* Heap usage command */
-void cmd_memstat(UNUSED_ARG const char* args) {
+/* Print the heap counters and the size class histogram, without walking the heap */
+static void memstat_summary() {
+    HeapStats stats;
+    heap_get_stats(&stats);
+
+    size_t total_kb  = stats.total >> 10;
+    size_t used_kb   = stats.used >> 10;
+    size_t cached_kb = stats.cached >> 10;
+    size_t free_kb   = total_kb - used_kb - cached_kb;
+
+    int usage_pct = (total_kb > 0) ? (int)((used_kb * 100) / total_kb) : 0;
+
+    printf("Total memory: %4lu KiB\n", total_kb);
+    printf("Used memory:  %4lu KiB [%d%%]\n", used_kb, usage_pct);
+    printf("Free memory:  %4lu KiB\n", free_kb);
+    printf("Magazines:    %4lu KiB\n", cached_kb);
+    printf("Total segments: %lu\n", stats.segments);
+    printf("Vmalloc used: %4lu KiB\n", stats.vmalloc >> 10);
+    printf("Allocations: %lu | Frees: %lu\n", stats.allocs, stats.frees);
+    printf("Physical memory: %lu / %lu KiB free\n",
+            pmm_get_free_pages() * (PAGE_SIZE >> 10), pmm_get_total_pages() * (PAGE_SIZE >> 10));
+
+    // Only worth a line each on a NUMA machine, a flat PMM is the line above
+    uint32_t nodes = pmm_get_node_count();
+    for (uint32_t node = 0; nodes > 1 && node < nodes; node++) {
+        PmmNodeStats numa;
+        if (!pmm_get_node_stats(node, &numa)) continue;
+
+        printf("  Node %u (domain %u): %lu / %lu KiB free\n", node, numa.domain,
+                numa.free_pages * (PAGE_SIZE >> 10), numa.total_pages * (PAGE_SIZE >> 10));
+    }
+
+    ZeroPoolStats zero;
+    zero_pool_stats(&zero);
+    printf("Zeroed pages: %lu ready | Hits: %lu | Misses: %lu\n", zero.cached, zero.hits, zero.misses);
+
+    printf("----------------------------------------------------------------------\n");
+    printf("Size class      | Allocations\n");
+    printf("----------------------------------------------------------------------\n");
+
+    for (uint32_t i = 0; i < HEAP_CLASS_COUNT; i++) {
+        if (stats.class_allocs[i] == 0) continue;
+        printf("<= %-12lu | %lu\n", (size_t) 16 << i, stats.class_allocs[i]);
+    }
+}
+
+/* Heap usage command, `-s` skips the segment dump */
+void cmd_memstat(const char* args) {
+    if (strcmp(args, "-s") == 0) {
+        memstat_summary();
+        return;
+    }
+
     // Disable interrupts to prevent the scheduler from
     // switching tasks while we use the heap.
     system_int_off();
@@ -79,13 +135,10 @@ void cmd_memstat(UNUSED_ARG const char* args) {
     printf("Address    | Size      | Status | Caller Address\n");
     printf("----------------------------------------------------------------------\n");
 
-    size_t total_kb  = 0;
     size_t heap_used = 0;
 
     HeapSegment* current = first_segment;
 
-    size_t total_segs = 0;
-
     while (current != NULL) {
         printf("%p | %-9lu | %-6s | 0x%08lX\n",
                 current,
@@ -93,28 +146,16 @@ void cmd_memstat(UNUSED_ARG const char* args) {
                 current->is_free ? "FREE" : "USED",
                 current->caller);
 
-        total_kb += current->size + sizeof(HeapSegment);
         if (!current->is_free) heap_used += current->size;
 
         current = current->next;
-        total_segs++;
     }
 
-    total_kb >>= 10;
-
-    size_t used_kb = heap_used >> 10;
-    size_t free_kb = total_kb - used_kb;
-
-    int usage_pct = (total_kb > 0) ? (int)((used_kb * 100) / total_kb) : 0;
-
     printf("----------------------------------------------------------------------\n");
     printf("Total Used: %lu bytes\n", heap_used);
     printf("----------------------------------------------------------------------\n");
 
-    printf("Total memory: %4lu KiB\n", total_kb);
-    printf("Used memory:  %4lu KiB [%d%%]\n", used_kb, usage_pct);
-    printf("Free memory:  %4lu KiB\n", free_kb);
-    printf("Total segments: %d\n", total_segs);
+    memstat_summary();
 
     system_int_on();
 }
@@ -157,6 +198,89 @@ void cmd_heapstat(UNUSED_ARG const char* args) {
     printf("Heap status is OK; %d segments verified, no corruption detected.\n", count);
 }
 
+/* Per-core heap magazine counters command */
+void cmd_heapmag(UNUSED_ARG const char* args) {
+    uint32_t cores = (core_count > 0) ? core_count : 1;
+
+    printf("Core | Hits       | Misses     | Cached | Hit rate\n");
+    printf("----------------------------------------------------\n");
+
+    for (uint32_t i = 0; i < cores; i++) {
+        HeapMagazineStats stats;
+        heap_magazine_stats(i, &stats);
+
+        uint64_t total = stats.hits + stats.misses;
+        int hit_pct = (total > 0) ? (int)((stats.hits * 100) / total) : 0;
+
+        printf("%-4u | %-10lu | %-10lu | %-6u | %d%%\n",
+                i, stats.hits, stats.misses, stats.cached, hit_pct);
+    }
+}
+
+/* Buddy allocator free blocks per order, and how much free memory each order can't use */
+void cmd_buddyinfo(UNUSED_ARG const char* args) {
+    PmmBuddyStats stats;
+    pmm_get_buddy_stats(&stats);
+
+    printf("Order | Block     | Free blocks | Unusable\n");
+    printf("----------------------------------------------\n");
+
+    // Free pages in blocks too small for the current order
+    size_t below = 0;
+
+    for (uint32_t i = 0; i <= PMM_MAX_ORDER; i++) {
+        int unusable = (stats.free_pages > 0) ? (int)((below * 100) / stats.free_pages) : 0;
+
+        printf("%-5u | %-6lu KiB | %-11lu | %d%%\n",
+                i, (PAGE_SIZE >> 10) << i, stats.free_blocks[i], unusable);
+
+        below += stats.free_blocks[i] << i;
+    }
+
+    printf("Free pages: %lu | In per-core caches: %lu\n", stats.free_pages, stats.cached_pages);
+}
+
+/* Heap allocation site profiler command */
+void cmd_heapprof(const char* args) {
+    if (strcmp(args, "start") == 0) {
+        heap_prof_start();
+        printf("Heap profiler started\n");
+        return;
+    }
+
+    if (strcmp(args, "stop") == 0) {
+        heap_prof_stop();
+        printf("Heap profiler stopped\n");
+        return;
+    }
+
+    if (strcmp(args, "reset") == 0) {
+        heap_prof_reset();
+        printf("Heap profiler reset\n");
+        return;
+    }
+
+    uint32_t max = (args[0] != '\0') ? (uint32_t) atoi(args) : 10;
+    if (max == 0 || max > HEAP_PROF_TOP_MAX) max = HEAP_PROF_TOP_MAX;
+
+    HeapProfSite sites[HEAP_PROF_TOP_MAX];
+    uint32_t count = heap_prof_top(sites, max);
+
+    printf("Profiler: %s | Untracked: %u\n", heap_prof_enabled ? "running" : "stopped", heap_prof_dropped());
+    printf("----------------------------------------------------------------------\n");
+    printf("Caller     | Allocs     | Live       | Live bytes | Peak bytes\n");
+    printf("----------------------------------------------------------------------\n");
+
+    for (uint32_t i = 0; i < count; i++) {
+        printf("0x%08X | %-10u | %-10u | %-10lu | %lu\n",
+                sites[i].caller,
+                sites[i].allocs,
+                sites[i].live_count,
+                sites[i].live_bytes,
+                sites[i].peak_bytes);
+    }
+}
+
 /* Run given interrupt command */
 void cmd_int(const char *args) {
     // TODO: x86 only, use HAL
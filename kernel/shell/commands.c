@@ -28,8 +28,11 @@ ShellCommand command_table[] = {
     {"clear", cmd_clear, "Clear the terminal screen"},
     {"echo", cmd_echo, "Echoes to the terminal"},
     {"secho", cmd_secho, "Write text to the serial port (COM1)"},
-    {"memstat", cmd_memstat, "Memory statistics"},
+    {"memstat", cmd_memstat, "Memory statistics (-s for counters only)"},
     {"heapstat", cmd_heapstat, "Verify heap health"},
+    {"heapmag", cmd_heapmag, "Per-core heap magazine hits and misses"},
+    {"heapprof", cmd_heapprof, "Heap allocation sites (start, stop, reset or top N)"},
+    {"buddyinfo", cmd_buddyinfo, "Free physical blocks per buddy order"},
     {"int", cmd_int, "Jump to given interrupt"},
 
     // fs